@@ -0,0 +1,113 @@
+#!/bin/bash
+# Throughput benchmark of MTP (run by make bench).
+#
+# Every run starts a fresh initmsocket and PAIRS sender/receiver pairs of mtpbench on 127.0.0.1, each pair
+# transferring SIZE KB, and prints one CSV line:
+#   sweep,loss,file_kb,window,pairs,messages,transmissions,tx_per_msg,completion_s,goodput_kbps,ok
+# messages counts the data chunks of all pairs (the '#' chunk included), transmissions the data frames sent and
+# resent by the sender sockets (sent + retx of mtpstat, read before the senders end), completion_s the time from starting the senders until the last receiver has everything and
+# goodput_kbps the file data delivered per second over all pairs. ok is 1 if every receiver got the exact data.
+#
+# Starting from the base point (BASE_LOSS, BASE_KB, BASE_WINDOW, BASE_PAIRS), the loss (LOSSES), the file size
+# (SIZES), the window (WINDOWS: RECV_BUFFSIZE, rebuilt for each value, at most SEND_BUFFSIZE / 2) and the number
+# of pairs (PAIRS) are swept one at a time. All of these can be set in the environment (an empty list skips that
+# sweep), e.g.  LOSSES="0.1 0.3" SIZES= WINDOWS= PAIRS="1 4" ./bench.sh
+
+LOSSES=${LOSSES-"0.05 0.1 0.15 0.2 0.25 0.3 0.35 0.4 0.45 0.5"}
+SIZES=${SIZES-"16 64 128"}
+WINDOWS=${WINDOWS-"1 2 3 4 5"}
+PAIRS=${PAIRS-"1 2 4 8"}
+BASE_LOSS=${BASE_LOSS:-0.1}
+BASE_KB=${BASE_KB:-64}
+BASE_WINDOW=${BASE_WINDOW:-5}
+BASE_PAIRS=${BASE_PAIRS:-1}
+SEED=${SEED:-1}
+RUN_TIMEOUT=${RUN_TIMEOUT:-900}
+PORT_BASE=${PORT_BASE:-20000}
+
+SRC=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d /tmp/mtpbench.XXXXXX)
+DAEMON=
+trap '[ -n "$DAEMON" ] && kill -INT $DAEMON 2>/dev/null; rm -rf "$WORK"' EXIT
+
+# build_window <window>: builds initmsocket, mtpbench and mtpstat with RECV_BUFFSIZE=<window> in their own directory.
+build_window()
+{
+    local dir="$WORK/w$1"
+    if [ ! -d "$dir" ]; then
+        mkdir -p "$dir"
+        # every source the makefile may need: the library is built from several files
+        cp "$SRC"/*.c "$SRC"/*.h "$SRC"/makefile "$dir"
+        make -s -C "$dir" CFLAGS="-O2 -DRECV_BUFFSIZE=$1" initmsocket mtpbench mtpstat >/dev/null || exit 1
+    fi
+    echo "$dir"
+}
+
+# run <sweep> <loss> <kb> <window> <pairs>
+run()
+{
+    local dir
+    dir=$(build_window "$4") || exit 1
+    cd "$dir" || exit 1
+
+    # The IPC objects are named after MTP_INSTANCE, not the directory: each window build (whose table layout
+    # differs) and each bench.sh gets its own instance, so its daemon never meets another one's table
+    local instance="bench$$-w$4"
+
+    MTP_INSTANCE=$instance MTP_SEED=$SEED ./initmsocket > daemon.log 2>&1 &
+    DAEMON=$!
+    sleep 0.5
+
+    local receivers=()
+    for ((k = 0; k < $5; k++)); do
+        MTP_INSTANCE=$instance ./mtpbench recv $((PORT_BASE + 2 * k + 1)) $((PORT_BASE + 2 * k)) "$3" "$2" "$SEED" > "recv$k.log" 2>&1 &
+        receivers+=($!)
+    done
+    sleep 0.3
+
+    local start end senders=() ports=" "
+    start=$(date +%s.%N)
+    for ((k = 0; k < $5; k++)); do
+        MTP_INSTANCE=$instance ./mtpbench send $((PORT_BASE + 2 * k)) $((PORT_BASE + 2 * k + 1)) "$3" "$2" "$SEED" > "send$k.log" 2>&1 &
+        senders+=($!)
+        ports="$ports$((PORT_BASE + 2 * k)) "
+    done
+    for pid in "${receivers[@]}"; do
+        timeout "$RUN_TIMEOUT" tail --pid="$pid" -f /dev/null
+    done
+    end=$(date +%s.%N)
+
+    # the senders keep their sockets open until now, so their counters are still in the table
+    local transmissions
+    transmissions=$(MTP_INSTANCE=$instance ./mtpstat | awk -v ports="$ports" 'NR == 1 { for (c = 1; c <= NF; c++) col[$c] = c; next }
+        { split($3, addr, ":"); if (index(ports, " " addr[2] " ")) tx += $col["sent"] + $col["retx"] }
+        END { print tx + 0 }')
+
+    kill "${receivers[@]}" "${senders[@]}" 2>/dev/null
+    kill -INT $DAEMON 2>/dev/null
+    wait $DAEMON 2>/dev/null
+    DAEMON=
+
+    local ok=1 bytes=0
+    for ((k = 0; k < $5; k++)); do
+        local result
+        result=$(grep RESULT "recv$k.log")
+        if [ -z "$result" ] || [ "$(echo "$result" | cut -d' ' -f4)" != 1 ]; then
+            ok=0
+        else
+            bytes=$((bytes + $(echo "$result" | cut -d' ' -f2)))
+        fi
+    done
+
+    awk -v s="$1" -v l="$2" -v kb="$3" -v w="$4" -v p="$5" -v tx="${transmissions:-0}" -v t0="$start" -v t1="$end" -v b="$bytes" -v ok="$ok" 'BEGIN {
+        msgs = p * (kb + 1); t = t1 - t0;
+        printf "%s,%s,%s,%s,%s,%d,%d,%.3f,%.2f,%.2f,%d\n", s, l, kb, w, p, msgs, tx, tx / msgs, t, b * 8 / 1000 / t, ok
+    }'
+    cd "$SRC" || exit 1
+}
+
+echo "sweep,loss,file_kb,window,pairs,messages,transmissions,tx_per_msg,completion_s,goodput_kbps,ok"
+for l in $LOSSES; do run loss "$l" "$BASE_KB" "$BASE_WINDOW" "$BASE_PAIRS"; done
+for kb in $SIZES; do run size "$BASE_LOSS" "$kb" "$BASE_WINDOW" "$BASE_PAIRS"; done
+for w in $WINDOWS; do run window "$BASE_LOSS" "$BASE_KB" "$w" "$BASE_PAIRS"; done
+for p in $PAIRS; do run pairs "$BASE_LOSS" "$BASE_KB" "$BASE_WINDOW" "$p"; done
@@ -13,12 +13,25 @@
 #include <sys/shm.h>
 #include <signal.h>
 #include <pthread.h>
+#include <time.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <linux/mempolicy.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <netinet/udp.h>
 #include "msocket.h"
 
+#ifndef MTP_INPROC
 // sembuf
 struct sembuf pop, vop;
-#define down(s) semop(s, &pop, 1) // wait(s)
-#define up(s) semop(s, &vop, 1)   // signal(s)
+#endif
 
 // argument for threads
 typedef struct argtype
@@ -29,11 +42,19 @@ typedef struct argtype
 
 // global varibales
 volatile sig_atomic_t sigint_received = 0;
-int sm_id_MTP_Table, sm_id_shared_vars;
+int sm_id_shared_vars;
 int mtx_table_info;
 int mtx_swnd, mtx_recvbuf, mtx_sendbuf;
 
 int total_message_sent = 0;
+unsigned long long impair_seed; // Seed of the impairment emulator, from MTP_SEED or the start time
+static __thread int impair_thread = IMPAIR_R; // Generator of the calling thread in impair_state (IMPAIR_S in S_Thread)
+int owner_pidfd[SIZE_SM];       // pidfd of the process owning each socket, -1 if none (G_Thread polls them)
+int g_wakeup_fd = -1;           // eventfd waking G_Thread when a pidfd is added
+int linger_pending[SIZE_SM];    // Pending messages of a socket whose owner exited, when G_Thread last saw them change
+time_t linger_since[SIZE_SM];   // When that was, 0 while the owner is alive
+char table_name[MTP_NAME_MAX];  // Shared memory object of the MTP table of the instance (mtp_table_name)
+char table_path[MTP_PATH_MAX];  // Its path on MTP_HUGETLBFS with MTP_HUGEPAGES=hugetlb
 
 /*
     Function: sock_converter
@@ -74,6 +95,7 @@ int max_logical(int x, int y, int size)
     }
 }
 
+#ifndef MTP_INPROC
 /*
     Function: min_logical
     Arguments: int x, int y, int size
@@ -113,242 +135,2844 @@ void my_strcpy(char *a1, char *a2, int size)
     }
     return;
 }
+#endif
+
+/*---------------------------------------LOGGING----------------------------------------------------------*/
+
+/*  Diagnostic output of the daemon threads goes through LOG(). Each thread formats its line into its own
+    single-producer ring and the log_flusher thread writes the rings to stdout, so no thread does stdio I/O
+    while holding a lock. A call below log_level costs one branch. Lines of one thread keep their order;
+    lines of different threads may be interleaved differently from the order they were logged in. */
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#define LOG(level, ...)                          \
+    do                                           \
+    {                                            \
+        if ((level) <= log_level)                \
+            log_write((level), __VA_ARGS__);     \
+    } while (0)
+
+typedef struct log_line
+{
+    int level;
+    char text[LOG_LINE_SIZE];
+} log_line;
+
+typedef struct log_ring
+{
+    unsigned int head CACHE_ALIGNED; // Next line to write, only advanced by the owning thread
+    unsigned int tail CACHE_ALIGNED; // Next line to flush, only advanced by the flusher
+    unsigned long long dropped;      // Lines lost because the ring was full
+    log_line lines[LOG_RING_SIZE];
+} log_ring;
+
+int log_level = LOG_INFO; // From MTP_LOG_LEVEL (0 error, 1 warn, 2 info, 3 debug)
+log_ring log_rings[LOG_MAX_THREADS];
+int log_ring_count = 0;
+__thread log_ring *my_log_ring = NULL;
+pthread_mutex_t log_flush_mtx = PTHREAD_MUTEX_INITIALIZER;
+const char *log_level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+/*
+    Function: log_write
+    Arguments: int level, const char *fmt, ...
+    Return Value: void
+    Workflow: Formats a log line into the ring of the calling thread, taking a ring on its first call.
+              The line is published to the flusher with a release store of head. If the ring is full the line is
+              dropped (and counted) rather than waiting for the flusher. A thread that finds no free ring left
+              writes the line to stdout directly.
+*/
+void log_write(int level, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+
+    if (my_log_ring == NULL)
+    {
+        int n = __atomic_fetch_add(&log_ring_count, 1, __ATOMIC_RELAXED);
+        if (n >= LOG_MAX_THREADS)
+        {
+            printf("[%s] ", log_level_names[level]);
+            vprintf(fmt, args);
+            va_end(args);
+            return;
+        }
+        my_log_ring = &log_rings[n];
+    }
+
+    log_ring *ring = my_log_ring;
+    unsigned int head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+    {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
+    }
+
+    log_line *line = &ring->lines[head % LOG_RING_SIZE];
+    line->level = level;
+    vsnprintf(line->text, LOG_LINE_SIZE, fmt, args);
+    va_end(args);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Function: log_flush
+    Arguments: None
+    Return Value: int
+    Workflow: Writes every published line of every ring to stdout, reports lines that were dropped and
+              returns the number of lines written.
+*/
+int log_flush()
+{
+    int written = 0;
+
+    pthread_mutex_lock(&log_flush_mtx);
+    int rings = __atomic_load_n(&log_ring_count, __ATOMIC_RELAXED);
+    if (rings > LOG_MAX_THREADS)
+        rings = LOG_MAX_THREADS;
+    for (int r = 0; r < rings; r++)
+    {
+        log_ring *ring = &log_rings[r];
+        unsigned int tail = ring->tail;
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head)
+        {
+            log_line *line = &ring->lines[tail % LOG_RING_SIZE];
+            printf("[%s] %s", log_level_names[line->level], line->text);
+            tail++;
+            written++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        unsigned long long dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped)
+            printf("[WARN] %llu log lines dropped, ring full\n", dropped);
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&log_flush_mtx);
+
+    return written;
+}
+
+/*
+    Function: log_flusher
+    Arguments: void *arg
+    Return Value: None (void *)
+    Workflow: Background thread writing the log rings to stdout, sleeping LOG_FLUSH_US whenever they are empty.
+              SIGINT is blocked here, so the exit of the daemon never runs log_flush_at_exit on this thread
+              while it holds log_flush_mtx.
+*/
+void *log_flusher(void *arg)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while (1)
+    {
+        if (log_flush() == 0)
+            usleep(LOG_FLUSH_US);
+    }
+    pthread_exit(NULL);
+}
+
+/*
+    Function: log_flush_at_exit
+    Arguments: None
+    Return Value: void
+    Workflow: atexit handler writing out the lines logged since the last flush.
+*/
+void log_flush_at_exit()
+{
+    log_flush();
+}
+
+/*
+    Function: log_start
+    Arguments: None
+    Return Value: void
+    Workflow: Reads the log level from MTP_LOG_LEVEL, starts the detached flusher thread and flushes the rings
+              once more at exit so that the last lines are not lost.
+*/
+void log_start()
+{
+    char *env = getenv("MTP_LOG_LEVEL");
+    if (env != NULL)
+        log_level = atoi(env);
+
+    pthread_t flusher;
+    if (pthread_create(&flusher, NULL, log_flusher, NULL) == 0)
+        pthread_detach(flusher);
+    atexit(log_flush_at_exit);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/*---------------------------------------IMPAIRMENT----------------------------------------------------------*/
+
+// A frame held back by the impairment emulator, delivered by R_Thread once due_ns has passed
+typedef struct delayed_frame
+{
+    unsigned long long due_ns;
+    unsigned long long order; // Arrival order, keeps frames with the same due time in order
+    int mtp_id;
+    int udp_sockid;           // To discard the frame if the socket was closed in the meantime
+    int bytes;
+    char data[FRAME_MAX];
+} delayed_frame;
+
+// Min-heap on due_ns, only touched by R_Thread
+delayed_frame delayed_frames[IMPAIR_QUEUE_SIZE];
+int delayed_count = 0;
+unsigned long long delayed_order = 0;
+
+/*
+    Function: monotonic_ns
+    Arguments: None
+    Return Value: unsigned long long
+    Workflow: Returns the current time of CLOCK_MONOTONIC in nanoseconds.
+*/
+unsigned long long monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+    Function: impair_init_seed
+    Arguments: None
+    Return Value: void
+    Workflow: Takes the seed of the impairment emulator from the environment variable MTP_SEED, or from the
+              current time if it is not set, and prints it so that a run can be repeated with the same losses.
+*/
+void impair_init_seed()
+{
+    char *env = getenv("MTP_SEED");
+    impair_seed = (env != NULL) ? strtoull(env, NULL, 0) : (unsigned long long)time(NULL);
+    LOG(LOG_INFO, "Impairment seed : %llu\n", impair_seed);
+}
+
+/*
+    Function: impair_uniform
+    Arguments: impair_state *st
+    Return Value: double
+    Workflow: Advances the splitmix64 generator of a socket for the calling thread and returns a uniform number in [0, 1).
+*/
+double impair_uniform(impair_state *st)
+{
+    unsigned long long z = (st->rng[impair_thread] += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return (double)(z >> 11) / 9007199254740992.0;
+}
+
+/*
+    Function: impair_reset
+    Arguments: mtp_socket *MTP_Table, int id
+    Return Value: void
+    Workflow: Reseeds the random state of socket id, from its configured seed or else from impair_seed and the
+              socket id, and puts the Gilbert-Elliott chains back in the good state. The generator of each thread
+              starts from that seed mixed with the thread index (R_Thread's is the seed itself).
+*/
+void impair_reset(mtp_socket *MTP_Table, int id)
+{
+    impair_state *st = &MTP_Table[id].impair_st;
+    unsigned long long seed = MTP_Table[id].impair.seed ? MTP_Table[id].impair.seed : impair_seed ^ ((unsigned long long)(id + 1) * 0x9E3779B97F4A7C15ULL);
+    for (int t = 0; t < IMPAIR_THREADS; t++)
+    {
+        st->rng[t] = seed ^ ((unsigned long long)t * 0xD1B54A32D192ED03ULL);
+        st->ge_bad[t] = 0;
+    }
+    st->link_free_ns = 0;
+}
+
+/*
+    Function: impair_holds_frames
+    Arguments: mtp_socket *MTP_Table, int id
+    Return Value: int
+    Workflow: Returns 1 if the impairment of socket id delays, reorders, duplicates, rate limits or corrupts frames,
+              that is if frames for it have to go through R_Thread (and its delay queue) and not only the loss model.
+*/
+int impair_holds_frames(mtp_socket *MTP_Table, int id)
+{
+    impair_config *cfg = &MTP_Table[id].impair;
+    return cfg->delay_us > 0 || cfg->jitter_us > 0 || cfg->reorder > 0 || cfg->duplicate > 0 || cfg->rate_kbps > 0 || cfg->corrupt > 0;
+}
+
+/*
+    Function: impair_drop
+    Arguments: mtp_socket *MTP_Table, int id
+    Return Value: int
+    Workflow: Decides whether a frame arriving at socket id is lost. With ge_p = 0 the loss is Bernoulli with
+              probability loss. Otherwise the Gilbert-Elliott chain of the calling thread first moves between its good
+              and bad states (with probabilities ge_p and ge_r) and the frame is lost with probability loss or ge_loss_bad.
+              Returns 1 if the frame is dropped, 0 otherwise.
+*/
+int impair_drop(mtp_socket *MTP_Table, int id)
+{
+    impair_config *cfg = &MTP_Table[id].impair;
+    impair_state *st = &MTP_Table[id].impair_st;
+
+    if (cfg->ge_p > 0)
+    {
+        if (st->ge_bad[impair_thread])
+            st->ge_bad[impair_thread] = !(impair_uniform(st) < cfg->ge_r);
+        else
+            st->ge_bad[impair_thread] = impair_uniform(st) < cfg->ge_p;
+    }
+    float p = st->ge_bad[impair_thread] ? cfg->ge_loss_bad : cfg->loss;
+    if (p > 0 && impair_uniform(st) < p)
+    {
+        STAT_ADD(MTP_Table[id], drops, 1);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Function: delayed_push
+    Arguments: int mtp_id, int udp_sockid, char *data, int bytes, unsigned long long due_ns
+    Return Value: int
+    Workflow: Inserts a copy of a frame into the delay heap. Returns 0 if the heap is full, in which case the
+              frame is lost like on the full queue of a router.
+*/
+int delayed_push(int mtp_id, int udp_sockid, char *data, int bytes, unsigned long long due_ns)
+{
+    if (delayed_count == IMPAIR_QUEUE_SIZE)
+        return 0;
+
+    delayed_frame f;
+    f.due_ns = due_ns;
+    f.order = delayed_order++;
+    f.mtp_id = mtp_id;
+    f.udp_sockid = udp_sockid;
+    f.bytes = bytes;
+    memcpy(f.data, data, bytes);
+
+    int c = delayed_count++;
+    while (c > 0)
+    {
+        int parent = (c - 1) / 2;
+        delayed_frame *p = &delayed_frames[parent];
+        if (p->due_ns < f.due_ns || (p->due_ns == f.due_ns && p->order < f.order))
+            break;
+        delayed_frames[c] = *p;
+        c = parent;
+    }
+    delayed_frames[c] = f;
+    return 1;
+}
+
+/*
+    Function: delayed_pop
+    Arguments: delayed_frame *out
+    Return Value: void
+    Workflow: Removes the earliest frame of the delay heap (which must not be empty) into out.
+*/
+void delayed_pop(delayed_frame *out)
+{
+    *out = delayed_frames[0];
+    delayed_frame last = delayed_frames[--delayed_count];
+
+    int c = 0;
+    while (1)
+    {
+        int child = 2 * c + 1;
+        if (child >= delayed_count)
+            break;
+        if (child + 1 < delayed_count &&
+            (delayed_frames[child + 1].due_ns < delayed_frames[child].due_ns ||
+             (delayed_frames[child + 1].due_ns == delayed_frames[child].due_ns && delayed_frames[child + 1].order < delayed_frames[child].order)))
+            child++;
+        if (last.due_ns < delayed_frames[child].due_ns || (last.due_ns == delayed_frames[child].due_ns && last.order < delayed_frames[child].order))
+            break;
+        delayed_frames[c] = delayed_frames[child];
+        c = child;
+    }
+    delayed_frames[c] = last;
+}
+
+/*
+    Function: impair_receive
+    Arguments: mtp_socket *MTP_Table, int i, char *udp_data, int bytes
+    Return Value: int
+    Workflow: Applies the impairment of socket i to a frame R_Thread has just received for it.
+              Returns 1 if the frame is to be processed right away, 0 if it was dropped or held back.
+        - Drop the frame according to the loss model.
+        - With probability corrupt flip one bit after the type and sequence number of a data frame.
+        - Without delay, reordering, duplication or rate limit the frame is processed right away.
+        - Queue a copy of the frame for duplication with probability duplicate.
+        - With probability reorder the frame skips the delay (and overtakes the frames held back).
+        - Otherwise it leaves the rate limited link after the previous frames, then waits delay_us +/- jitter_us
+          in the delay heap.
+*/
+int impair_receive(mtp_socket *MTP_Table, int i, char *udp_data, int bytes)
+{
+    impair_config *cfg = &MTP_Table[i].impair;
+    impair_state *st = &MTP_Table[i].impair_st;
+
+    if (impair_drop(MTP_Table, i))
+        return 0;
+
+    if (cfg->corrupt > 0 && (udp_data[0] == 'D' || udp_data[0] == 'C') && bytes > 2 && impair_uniform(st) < cfg->corrupt)
+    {
+        int bit = (int)(impair_uniform(st) * (bytes - 2) * 8);
+        udp_data[2 + bit / 8] ^= (char)(1 << (bit % 8));
+    }
+
+    if (!impair_holds_frames(MTP_Table, i))
+        return 1;
+
+    unsigned long long now = monotonic_ns();
+    unsigned long long due = now;
+
+    if (cfg->rate_kbps > 0)
+    {
+        if (st->link_free_ns < now)
+            st->link_free_ns = now;
+        st->link_free_ns += (unsigned long long)bytes * 8000000ULL / cfg->rate_kbps;
+        due = st->link_free_ns;
+    }
+
+    if (cfg->duplicate > 0 && impair_uniform(st) < cfg->duplicate)
+    {
+        if (!delayed_push(i, MTP_Table[i].udp_sockid, udp_data, bytes, due))
+            STAT_ADD(MTP_Table[i], drops, 1);
+    }
+
+    if (cfg->reorder > 0 && impair_uniform(st) < cfg->reorder)
+    {
+        if (due == now)
+            return 1;
+        if (!delayed_push(i, MTP_Table[i].udp_sockid, udp_data, bytes, due))
+            STAT_ADD(MTP_Table[i], drops, 1);
+        return 0;
+    }
+
+    long long delay_us = cfg->delay_us;
+    if (cfg->jitter_us > 0)
+    {
+        delay_us += (long long)(impair_uniform(st) * (2 * cfg->jitter_us + 1)) - cfg->jitter_us;
+    }
+    if (delay_us > 0)
+        due += delay_us * 1000;
+
+    if (due == now)
+        return 1;
+
+    if (!delayed_push(i, MTP_Table[i].udp_sockid, udp_data, bytes, due))
+        STAT_ADD(MTP_Table[i], drops, 1);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/*---------------------------------------CHECKSUM----------------------------------------------------------*/
+
+unsigned int crc32c_table[256]; // Byte-at-a-time table of the portable CRC32C
+
+/*
+    Function: crc32c_sw
+    Arguments: unsigned int crc, const unsigned char *data, int n
+    Return Value: unsigned int
+    Workflow: Portable CRC32C (Castagnoli, reflected polynomial 0x82F63B78) update over n bytes, one table lookup per byte.
+*/
+unsigned int crc32c_sw(unsigned int crc, const unsigned char *data, int n)
+{
+    while (n-- > 0)
+        crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+/*
+    Function: crc32c_hw
+    Arguments: unsigned int crc, const unsigned char *data, int n
+    Return Value: unsigned int
+    Workflow: CRC32C update with the SSE4.2 crc32 instruction, 8 bytes at a time. Only called if the CPU has SSE4.2.
+*/
+__attribute__((target("sse4.2"))) unsigned int crc32c_hw(unsigned int crc, const unsigned char *data, int n)
+{
+    unsigned long long crc64 = crc;
+    for (; n >= 8; n -= 8, data += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, data, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+    }
+    crc = (unsigned int)crc64;
+    while (n-- > 0)
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    return crc;
+}
+#endif
+
+unsigned int (*crc32c_update)(unsigned int, const unsigned char *, int) = crc32c_sw;
+
+/*
+    Function: crc32c_init
+    Arguments: None
+    Return Value: void
+    Workflow: Builds the table of the portable implementation and selects the SSE4.2 one if the CPU supports it.
+*/
+void crc32c_init()
+{
+    for (unsigned int b = 0; b < 256; b++)
+    {
+        unsigned int crc = b;
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        crc32c_table[b] = crc;
+    }
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_update = crc32c_hw;
+#endif
+    if (FRAME_CRC)
+        LOG(LOG_INFO, "Frame CRC32C: %s\n", (crc32c_update == crc32c_sw) ? "portable" : "sse4.2");
+}
+
+/*
+    Function: crc32c
+    Arguments: const char *data, int n
+    Return Value: unsigned int
+    Workflow: Returns the CRC32C of n bytes.
+*/
+unsigned int crc32c(const char *data, int n)
+{
+    return ~crc32c_update(~0u, (const unsigned char *)data, n);
+}
+
+/*
+    Function: frame_crc_put, frame_crc_ok
+    Arguments: char *frame, int len; char *frame, int bytes
+    Return Value: int; int
+    Workflow: With FRAME_CRC a data frame ('D' or compressed 'C') ends with the CRC32C of everything after the frame type
+              in 4 bytes, least significant first. frame_crc_put appends it to a frame of len bytes and returns the new length;
+              frame_crc_ok returns 1 if a received frame (without stream id) has the right CRC, and the right size for 'D'.
+*/
+int frame_crc_put(char *frame, int len)
+{
+    unsigned int crc = crc32c(frame + 1, len - 1);
+    for (int b = 0; b < 4; b++)
+        frame[len + b] = (char)(crc >> (8 * b));
+    return len + 4;
+}
+
+int frame_crc_ok(char *frame, int bytes)
+{
+    if (bytes < 6 || (frame[0] == 'D' && bytes != KB + 6))
+        return 0;
+
+    unsigned int crc = 0;
+    for (int b = 0; b < 4; b++)
+        crc |= (unsigned int)(unsigned char)frame[bytes - 4 + b] << (8 * b);
+    return crc == crc32c(frame + 1, bytes - 5);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/*---------------------------------------COMPRESSION----------------------------------------------------------*/
+
+/*  LZ77 in the style of the LZ4 block format: a sequence of (token, literals, match) where the token holds the
+    literal count in its high nibble and the match length - LZ_MIN_MATCH in its low nibble, a nibble of 15 being
+    continued by bytes of 255 and a final byte < 255. The match is a 2-byte offset (least significant first) back
+    into the output, followed by the extra match length bytes. The last sequence has literals only. */
+
+/*
+    Function: lz_put_length
+    Arguments: char *dst, int *op, int cap, int extra
+    Return Value: int
+    Workflow: Writes the continuation bytes of a length whose nibble was 15. Returns 0 if they do not fit in cap bytes.
+*/
+int lz_put_length(char *dst, int *op, int cap, int extra)
+{
+    for (; extra >= 255; extra -= 255)
+    {
+        if (*op >= cap)
+            return 0;
+        dst[(*op)++] = (char)255;
+    }
+    if (*op >= cap)
+        return 0;
+    dst[(*op)++] = (char)extra;
+    return 1;
+}
+
+/*
+    Function: lz_put_sequence
+    Arguments: char *dst, int *op, int cap, const char *literals, int lit_len, int offset, int match_len
+    Return Value: int
+    Workflow: Writes a sequence of lit_len literals followed by a match (none if match_len is 0).
+              Returns 0 if it does not fit in cap bytes.
+*/
+int lz_put_sequence(char *dst, int *op, int cap, const char *literals, int lit_len, int offset, int match_len)
+{
+    int lit_nibble = (lit_len < 15) ? lit_len : 15;
+    int match_nibble = 0;
+    if (match_len > 0)
+        match_nibble = (match_len - LZ_MIN_MATCH < 15) ? match_len - LZ_MIN_MATCH : 15;
+
+    if (*op >= cap)
+        return 0;
+    dst[(*op)++] = (char)((lit_nibble << 4) | match_nibble);
+    if (lit_nibble == 15 && !lz_put_length(dst, op, cap, lit_len - 15))
+        return 0;
+    if (*op + lit_len > cap)
+        return 0;
+    memcpy(dst + *op, literals, lit_len);
+    *op += lit_len;
+
+    if (match_len == 0)
+        return 1;
+    if (*op + 2 > cap)
+        return 0;
+    dst[(*op)++] = (char)(offset & 0xff);
+    dst[(*op)++] = (char)(offset >> 8);
+    if (match_nibble == 15 && !lz_put_length(dst, op, cap, match_len - LZ_MIN_MATCH - 15))
+        return 0;
+    return 1;
+}
+
+/*
+    Function: lz_compress
+    Arguments: const char *src, int n, char *dst, int cap
+    Return Value: int
+    Workflow: Compresses n bytes into at most cap bytes with greedy matching: each position looks up the last position
+              with the same 4 bytes in a hash table and extends the match as far as it goes.
+              Returns the compressed size, or -1 if it would not fit in cap bytes (the block does not compress enough).
+*/
+int lz_compress(const char *src, int n, char *dst, int cap)
+{
+    int last_pos[1 << LZ_HASH_BITS];
+    memset(last_pos, -1, sizeof(last_pos));
+
+    int ip = 0, anchor = 0, op = 0;
+    while (ip + LZ_MIN_MATCH <= n)
+    {
+        unsigned int quad;
+        memcpy(&quad, src + ip, 4);
+        unsigned int h = (quad * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = last_pos[h];
+        last_pos[h] = ip;
+
+        if (ref < 0 || ip - ref > 65535 || memcmp(src + ref, src + ip, 4) != 0)
+        {
+            ip++;
+            continue;
+        }
+
+        int match_len = LZ_MIN_MATCH;
+        while (ip + match_len < n && src[ref + match_len] == src[ip + match_len])
+            match_len++;
+
+        if (!lz_put_sequence(dst, &op, cap, src + anchor, ip - anchor, ip - ref, match_len))
+            return -1;
+        ip += match_len;
+        anchor = ip;
+    }
+    if (!lz_put_sequence(dst, &op, cap, src + anchor, n - anchor, 0, 0))
+        return -1;
+    return op;
+}
+
+/*
+    Function: lz_get_length
+    Arguments: const char *src, int n, int *ip, int *len
+    Return Value: int
+    Workflow: Adds the continuation bytes of a length whose nibble was 15 to *len. Returns 0 if the input ends first.
+*/
+int lz_get_length(const char *src, int n, int *ip, int *len)
+{
+    unsigned char byte;
+    do
+    {
+        if (*ip >= n)
+            return 0;
+        byte = (unsigned char)src[(*ip)++];
+        *len += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+/*
+    Function: lz_decompress
+    Arguments: const char *src, int n, char *dst, int cap
+    Return Value: int
+    Workflow: Decompresses n bytes of lz_compress output into at most cap bytes, checking every length and offset against
+              the input and output bounds (the input comes from the network). Returns the decompressed size, or -1 if the
+              input is malformed.
+*/
+int lz_decompress(const char *src, int n, char *dst, int cap)
+{
+    int ip = 0, op = 0;
+    while (ip < n)
+    {
+        unsigned char token = (unsigned char)src[ip++];
+
+        int lit_len = token >> 4;
+        if (lit_len == 15 && !lz_get_length(src, n, &ip, &lit_len))
+            return -1;
+        if (ip + lit_len > n || op + lit_len > cap)
+            return -1;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // the last sequence has no match
+        if (ip == n)
+            break;
+
+        if (ip + 2 > n)
+            return -1;
+        int offset = (unsigned char)src[ip] | ((unsigned char)src[ip + 1] << 8);
+        ip += 2;
+        int match_len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15 && !lz_get_length(src, n, &ip, &match_len))
+            return -1;
+        if (offset == 0 || offset > op || op + match_len > cap)
+            return -1;
+
+        // byte by byte, since the match may overlap the bytes it produces
+        for (int k = 0; k < match_len; k++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/*---------------------------------------PLACEMENT----------------------------------------------------------*/
+
+/*
+    Function: parse_cpu_list
+    Arguments: const char *list, unsigned long *mask
+    Return Value: int
+    Workflow: Sets in mask (MAX_CPUS bits, cleared first) the CPUs of a list such as "3", "2,6" or "0-3,8": numbers
+              and ranges separated by commas. Returns the number of CPUs, or -1 if the list is not valid or names a
+              CPU from MAX_CPUS on.
+*/
+int parse_cpu_list(const char *list, unsigned long *mask)
+{
+    const int bits = 8 * sizeof(unsigned long);
+    memset(mask, 0, MAX_CPUS / 8);
+
+    int count = 0;
+    const char *c = list;
+    while (*c != '\0')
+    {
+        char *end;
+        long first = strtol(c, &end, 10);
+        long last = first;
+        if (end == c)
+            return -1;
+        if (*end == '-')
+        {
+            c = end + 1;
+            last = strtol(c, &end, 10);
+            if (end == c)
+                return -1;
+        }
+        if (first < 0 || last < first || last >= MAX_CPUS)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            if (!(mask[cpu / bits] & (1UL << (cpu % bits))))
+                count++;
+            mask[cpu / bits] |= 1UL << (cpu % bits);
+        }
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        c = end;
+    }
+    return (count > 0) ? count : -1;
+}
+
+/*
+    Function: place_thread
+    Arguments: const char *name
+    Return Value: void
+    Workflow: Called by R_Thread and S_Thread when they start, with "R" or "S". Pins the calling thread to the CPUs
+              listed in the environment variable MTP_CPU_R or MTP_CPU_S (see parse_cpu_list) and sets its priority
+              from MTP_PRIO: 1 to 99 runs it under SCHED_FIFO with that real-time priority, -20 to -1 raises it with
+              that nice value. Both need CAP_SYS_NICE (or an RLIMIT_RTPRIO / RLIMIT_NICE allowing them); a setting
+              that fails is logged and the thread keeps running where the scheduler puts it.
+*/
+void place_thread(const char *name)
+{
+    char var[16];
+    snprintf(var, sizeof(var), "MTP_CPU_%s", name);
+    char *cpus = getenv(var);
+    if (cpus != NULL && cpus[0] != '\0')
+    {
+        unsigned long mask[MAX_CPUS / (8 * sizeof(unsigned long))];
+        if (parse_cpu_list(cpus, mask) < 0)
+            LOG(LOG_WARN, "%s: invalid CPU list %s\n", var, cpus);
+        else if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0)
+            LOG(LOG_WARN, "%s Thread: CPUs %s: %s\n", name, cpus, strerror(errno));
+        else
+            LOG(LOG_INFO, "%s Thread pinned to CPUs %s\n", name, cpus);
+    }
+
+    char *prio = getenv("MTP_PRIO");
+    if (prio == NULL || prio[0] == '\0')
+        return;
+    int value = atoi(prio);
+    if (value >= 1 && value <= 99)
+    {
+        struct sched_param param = {.sched_priority = value};
+        int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret != 0)
+            LOG(LOG_WARN, "%s Thread: SCHED_FIFO %d: %s\n", name, value, strerror(ret));
+        else
+            LOG(LOG_INFO, "%s Thread runs SCHED_FIFO at priority %d\n", name, value);
+    }
+    else if (value >= -20 && value <= -1)
+    {
+        if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), value) < 0)
+            LOG(LOG_WARN, "%s Thread: nice %d: %s\n", name, value, strerror(errno));
+        else
+            LOG(LOG_INFO, "%s Thread runs at nice %d\n", name, value);
+    }
+    else
+    {
+        LOG(LOG_WARN, "MTP_PRIO: %s is neither a real-time priority (1 to 99) nor a nice value (-20 to -1)\n", prio);
+    }
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/*---------------------------------------RECEIVE TIMESTAMPS----------------------------------------------------------*/
+
+/*  The UDP sockets have SO_TIMESTAMPNS on: every read comes with the time the kernel received the datagram. R_Thread
+    keeps it in frame_arrival_ns while it processes the frames of that read, so that the RTT sample of an ACK
+    (update_swnd_on_ack) ends when the ACK reached the host, not when R_Thread got to it. */
+
+#define RECV_CONTROL (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timespec))) // UDP_GRO and SCM_TIMESTAMPNS
+
+static __thread unsigned long long frame_arrival_ns = 0; // Kernel arrival (CLOCK_MONOTONIC) of the frames being processed, 0 if unknown
+
+/*
+    Function: enable_timestamps
+    Arguments: int fd
+    Return Value: void
+    Workflow: Turns SO_TIMESTAMPNS on for a UDP socket created for an MTP socket.
+*/
+void enable_timestamps(int fd)
+{
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+}
+
+/*
+    Function: kernel_arrival_ns
+    Arguments: struct msghdr *msg
+    Return Value: unsigned long long
+    Workflow: Returns the time the kernel received the datagrams read with recvmsg, from their SCM_TIMESTAMPNS control
+              message, or 0 if there is none. The kernel stamps CLOCK_REALTIME; the time is moved to CLOCK_MONOTONIC,
+              the clock of the send times, by taking off how long ago it was.
+*/
+unsigned long long kernel_arrival_ns(struct msghdr *msg)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            struct timespec ts, now;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            clock_gettime(CLOCK_REALTIME, &now);
+            long long age = (long long)(now.tv_sec - ts.tv_sec) * 1000000000LL + (now.tv_nsec - ts.tv_nsec);
+            unsigned long long mono = monotonic_ns();
+            return (age > 0 && (unsigned long long)age < mono) ? mono - age : mono;
+        }
+    }
+    return 0;
+}
+
+/*
+    Function: frame_time_ns
+    Arguments: None
+    Return Value: unsigned long long
+    Workflow: Returns the time the frame being processed arrived: its kernel timestamp in R_Thread, now otherwise
+              (local fast path, frames released by the impairment emulator).
+*/
+unsigned long long frame_time_ns()
+{
+    return (frame_arrival_ns != 0) ? frame_arrival_ns : monotonic_ns();
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/*---------------------------------------SEGMENTATION OFFLOAD----------------------------------------------------------*/
+
+/*  With UDP_OFFLOAD the data frames S_Thread sends in one walk of a window go to the kernel as one send with
+    UDP_SEGMENT (GSO), which the kernel or the NIC cuts into the usual datagrams, and the UDP sockets have UDP_GRO on,
+    so that datagrams of one sender arriving together come up to R_Thread as one buffer, cut again by
+    receive_segments. The datagrams on the wire do not change, so peers with and without offload talk to each other. */
+
+// Frames of one UDP socket and destination waiting for one GSO send: segments of seg_size bytes, the last one maybe shorter
+typedef struct gso_batch
+{
+    int fd;
+    struct sockaddr_in dest;
+    int seg_size;
+    int count;
+    int len;
+    char data[GSO_MAX_BYTES];
+} gso_batch;
+
+static __thread gso_batch *thread_batch = NULL; // Batch of S_Thread, NULL in the threads that send frame by frame
+int gso_off = 0;                                // Set once the kernel refused a GSO send: frames go one by one
+
+/*
+    Function: enable_gro
+    Arguments: int fd
+    Return Value: void
+    Workflow: Turns UDP_GRO on for a UDP socket created for an MTP socket, with UDP_OFFLOAD. A kernel without it
+              keeps delivering one datagram per read.
+*/
+void enable_gro(int fd)
+{
+    int one = 1;
+    if (UDP_OFFLOAD)
+        setsockopt(fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one));
+}
+
+/*
+    Function: gro_segment_size
+    Arguments: struct msghdr *msg
+    Return Value: int
+    Workflow: Returns the segment size of a GRO batch read with recvmsg, from its UDP_GRO control message, or 0 if the
+              buffer holds a single datagram.
+*/
+int gro_segment_size(struct msghdr *msg)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size;
+        }
+    }
+    return 0;
+}
+
+/*
+    Function: gso_control
+    Arguments: struct msghdr *msg, char *control, int seg_size
+    Return Value: void
+    Workflow: Attaches to msg the UDP_SEGMENT control message asking the kernel to cut the data into seg_size byte
+              datagrams. control has CMSG_SPACE(sizeof(unsigned short)) bytes.
+*/
+void gso_control(struct msghdr *msg, char *control, int seg_size)
+{
+    unsigned short size = seg_size;
+    memset(control, 0, CMSG_SPACE(sizeof(size)));
+    msg->msg_control = control;
+    msg->msg_controllen = CMSG_SPACE(sizeof(size));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+    memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+}
+
+/*
+    Function: send_one_by_one
+    Arguments: int fd, struct sockaddr_in *dest, char *data, int len, int seg_size
+    Return Value: void
+    Workflow: Sends the segments of a GSO send the kernel refused (no GSO in the kernel, or a device that can not
+              checksum them: EIO) as separate datagrams, and stops using GSO.
+*/
+void send_one_by_one(int fd, struct sockaddr_in *dest, char *data, int len, int seg_size)
+{
+    if (!gso_off)
+        LOG(LOG_WARN, "UDP GSO refused (%s), sending frames one by one\n", strerror(errno));
+    gso_off = 1;
+    for (int off = 0; off < len; off += seg_size)
+        sendto(fd, data + off, (len - off < seg_size) ? len - off : seg_size, 0, (struct sockaddr *)dest, sizeof(*dest));
+}
+
+/*
+    Function: send_direct
+    Arguments: int fd, struct sockaddr_in *dest, char *data, int len, int seg_size
+    Return Value: void
+    Workflow: Sends data from UDP socket fd to dest with one system call: as one datagram if seg_size is 0, or as
+              datagrams of seg_size bytes (the last one possibly shorter) with UDP_SEGMENT.
+*/
+void send_direct(int fd, struct sockaddr_in *dest, char *data, int len, int seg_size)
+{
+    if (seg_size == 0)
+    {
+        sendto(fd, data, len, 0, (struct sockaddr *)dest, sizeof(*dest));
+        return;
+    }
+
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    char control[CMSG_SPACE(sizeof(unsigned short))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = dest;
+    msg.msg_namelen = sizeof(*dest);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    gso_control(&msg, control, seg_size);
+    if (sendmsg(fd, &msg, 0) < 0 && errno != EAGAIN && errno != ENOBUFS)
+        send_one_by_one(fd, dest, data, len, seg_size);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/*---------------------------------------IO_URING----------------------------------------------------------*/
+
+/*  Alternative I/O backend of the R and S threads, selected with MTP_IO=uring (Linux 6.0 or later). Each thread has
+    its own ring, set up with the raw system calls. R_Thread keeps one multishot receive (IORING_OP_RECVMSG) armed on
+    every UDP socket in use, reading into a ring of buffers it provides to the kernel, and send_frame queues the
+    frames of the thread as IORING_OP_SENDMSG, submitted in batches: by R_Thread with its wait for datagrams, by
+    S_Thread at the end of each pass. So a wakeup of R_Thread or a pass of S_Thread costs one io_uring_enter
+    instead of one recvfrom or sendto per frame. */
+
+#define URING_BGID 0                // Buffer group of the receive buffers
+#define URING_SEND_TAG (1ULL << 63) // user_data of a send, with its slot in the low bits; a receive carries its UDP socket
+#define URING_PAYLOAD (UDP_OFFLOAD ? GRO_BUF_SIZE : FRAME_MAX) // Room for a GRO batch, or a frame
+// One receive buffer: the recvmsg header, the sender address, the control messages and the datagrams
+#define URING_BUF_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + RECV_CONTROL + URING_PAYLOAD)
+
+// A frame, or the frames of a GSO send, queued for sending: the sendmsg arguments stay valid until its completion
+typedef struct uring_send
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_in dest;
+    int fd;
+    int seg_size;
+    char control[CMSG_SPACE(sizeof(unsigned short))];
+    char frame[GSO_MAX_BYTES];
+} uring_send;
+
+// io_uring of one daemon thread
+typedef struct mtp_uring
+{
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_array;
+    unsigned int sq_mask, sq_entries;
+    unsigned int *cq_head, *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int sq_pending;            // SQEs written since the last io_uring_enter
+    uring_send sends[URING_SENDS];
+    int free_sends[URING_SENDS];        // Stack of the free send slots
+    int free_count;
+    struct io_uring_buf_ring *buf_ring; // Receive buffers provided to the kernel (R_Thread only)
+    char *bufs;
+    unsigned short buf_tail;
+    struct msghdr recv_msg;             // Template of the multishot receives: room for the sender address and RECV_CONTROL
+    int armed[SIZE_SM];                 // UDP sockets with a multishot receive armed
+    int armed_count;
+} mtp_uring;
+
+static __thread mtp_uring *thread_uring = NULL; // Ring of the calling thread, NULL when it uses the socket calls
+int r_uring_fd = -1;                            // Ring of R_Thread, whose receives close_udp_socket cancels
+pthread_mutex_t uring_arm_lock = PTHREAD_MUTEX_INITIALIZER; // Held by R_Thread while it arms receives, and by close_udp_socket
+
+/*
+    Function: uring_wanted
+    Arguments: None
+    Return Value: int
+    Workflow: Returns 1 if the environment variable MTP_IO selects the io_uring backend ("uring"), 0 for the default
+              one (select, recvfrom and sendto).
+*/
+int uring_wanted()
+{
+    char *env = getenv("MTP_IO");
+    return env != NULL && strcmp(env, "uring") == 0;
+}
+
+/*
+    Function: uring_recycle
+    Arguments: mtp_uring *u, int bid
+    Return Value: void
+    Workflow: Gives receive buffer bid back to the kernel, at the tail of the provided buffer ring.
+*/
+void uring_recycle(mtp_uring *u, int bid)
+{
+    struct io_uring_buf *b = &u->buf_ring->bufs[u->buf_tail & (URING_BUFS - 1)];
+    b->addr = (unsigned long)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+    Function: uring_open
+    Arguments: const char *name, int receive
+    Return Value: mtp_uring *
+    Workflow: Sets up the io_uring of the calling thread (named "R" or "S" in the log) and maps its rings; with receive
+              set, also registers URING_BUFS receive buffers as a provided buffer ring. The ring of S_Thread is only
+              used by it (single issuer, completions run when it enters the kernel); the one of R_Thread is not, as
+              close_udp_socket cancels its receives from other threads. Returns NULL, after logging why, if the kernel
+              does not support it or a step fails (the thread then keeps using the socket calls); whatever was set up
+              by then is unmapped and closed.
+*/
+mtp_uring *uring_open(const char *name, int receive)
+{
+    mtp_uring *u = calloc(1, sizeof(mtp_uring));
+    if (u == NULL)
+    {
+        LOG(LOG_WARN, "%s Thread: io_uring: %s, using the socket calls\n", name, strerror(errno));
+        return NULL;
+    }
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = receive ? 0 : IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0 && errno == EINVAL && p.flags != 0)
+    {
+        memset(&p, 0, sizeof(p));
+        u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (u->fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+    {
+        LOG(LOG_WARN, "%s Thread: io_uring: %s, using the socket calls\n", name, (u->fd < 0) ? strerror(errno) : "kernel too old");
+        if (u->fd >= 0)
+            close(u->fd);
+        free(u);
+        return NULL;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    size_t sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    char *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        LOG(LOG_WARN, "%s Thread: io_uring rings: %s, using the socket calls\n", name, strerror(errno));
+        if (ring != MAP_FAILED)
+            munmap(ring, ring_size);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        close(u->fd);
+        free(u);
+        return NULL;
+    }
+    u->sq_head = (unsigned int *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+    u->sq_array = (unsigned int *)(ring + p.sq_off.array);
+    u->sq_mask = *(unsigned int *)(ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned int *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned int *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    u->sqes = sqes;
+
+    for (int k = 0; k < URING_SENDS; k++)
+        u->free_sends[k] = k;
+    u->free_count = URING_SENDS;
+
+    if (receive)
+    {
+        size_t buf_ring_size = URING_BUFS * sizeof(struct io_uring_buf);
+        u->buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        u->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (unsigned long)u->buf_ring;
+        reg.ring_entries = URING_BUFS;
+        reg.bgid = URING_BGID;
+        if (u->buf_ring == MAP_FAILED || u->bufs == NULL ||
+            syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            LOG(LOG_WARN, "%s Thread: io_uring receive buffers: %s, using the socket calls\n", name, strerror(errno));
+            if (u->buf_ring != MAP_FAILED)
+                munmap(u->buf_ring, buf_ring_size);
+            munmap(ring, ring_size);
+            munmap(sqes, sqes_size);
+            close(u->fd);
+            free(u->bufs);
+            free(u);
+            return NULL;
+        }
+        for (int bid = 0; bid < URING_BUFS; bid++)
+            uring_recycle(u, bid);
+        u->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+        u->recv_msg.msg_controllen = RECV_CONTROL;
+        r_uring_fd = u->fd;
+    }
+
+    LOG(LOG_INFO, "%s Thread: io_uring with %u entries%s\n", name, p.sq_entries, receive ? ", multishot receives" : "");
+    return u;
+}
+
+/*
+    Function: uring_submit
+    Arguments: mtp_uring *u, unsigned int wait_nr, unsigned long long timeout_ns
+    Return Value: int
+    Workflow: Hands the SQEs written since the last call to the kernel and, if wait_nr is not 0, waits until that many
+              completions are there or timeout_ns has passed. Returns the result of io_uring_enter (-1 with errno
+              ETIME on a timeout). The kernel may take fewer SQEs than were pending (e.g. when one fails): the others
+              stay pending and go with the next call.
+*/
+int uring_submit(mtp_uring *u, unsigned int wait_nr, unsigned long long timeout_ns)
+{
+    struct __kernel_timespec ts = {.tv_sec = timeout_ns / 1000000000ULL, .tv_nsec = timeout_ns % 1000000000ULL};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long)&ts;
+
+    unsigned int flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    int ret = syscall(__NR_io_uring_enter, u->fd, u->sq_pending, wait_nr, flags, (wait_nr > 0) ? &arg : NULL, sizeof(arg));
+    if (ret >= 0)
+    {
+        unsigned int submitted = (unsigned int)ret;
+        u->sq_pending -= (submitted < u->sq_pending) ? submitted : u->sq_pending;
+    }
+    return ret;
+}
+
+/*
+    Function: uring_sqe
+    Arguments: mtp_uring *u
+    Return Value: struct io_uring_sqe *
+    Workflow: Returns a cleared SQE at the tail of the submission queue, submitting the queued ones first if it is full.
+              The SQE is handed to the kernel by the next uring_submit.
+*/
+struct io_uring_sqe *uring_sqe(mtp_uring *u)
+{
+    unsigned int tail = *u->sq_tail;
+    while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+        uring_submit(u, 0, 0);
+
+    struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+    return sqe;
+}
+
+/*
+    Function: uring_queue
+    Arguments: mtp_uring *u
+    Return Value: void
+    Workflow: Makes the SQE returned by uring_sqe visible to the kernel.
+*/
+void uring_queue(mtp_uring *u)
+{
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+    u->sq_pending++;
+}
+
+/*
+    Function: uring_send_frame
+    Arguments: mtp_uring *u, int fd, struct sockaddr_in *dest, char *frame, int len, int seg_size
+    Return Value: void
+    Workflow: Queues a copy of the frame for sending from UDP socket fd to dest, or of several frames cut into
+              seg_size byte datagrams by the kernel if seg_size is not 0 (see send_direct). If URING_SENDS sends are
+              already in flight it is sent at once with send_direct instead of waiting for a completion.
+*/
+void uring_send_frame(mtp_uring *u, int fd, struct sockaddr_in *dest, char *frame, int len, int seg_size)
+{
+    if (u->free_count == 0)
+    {
+        send_direct(fd, dest, frame, len, seg_size);
+        return;
+    }
+
+    int slot = u->free_sends[--u->free_count];
+    uring_send *snd = &u->sends[slot];
+    memcpy(snd->frame, frame, len);
+    snd->dest = *dest;
+    snd->iov.iov_base = snd->frame;
+    snd->iov.iov_len = len;
+    memset(&snd->msg, 0, sizeof(snd->msg));
+    snd->msg.msg_name = &snd->dest;
+    snd->msg.msg_namelen = sizeof(snd->dest);
+    snd->msg.msg_iov = &snd->iov;
+    snd->msg.msg_iovlen = 1;
+    snd->fd = fd;
+    snd->seg_size = seg_size;
+    if (seg_size > 0)
+        gso_control(&snd->msg, snd->control, seg_size);
+
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)&snd->msg;
+    sqe->len = 1;
+    sqe->user_data = URING_SEND_TAG | slot;
+    uring_queue(u);
+}
+
+/*
+    Function: uring_arm_receive
+    Arguments: mtp_uring *u, int fd
+    Return Value: void
+    Workflow: Queues a multishot receive on UDP socket fd unless one is armed already. It stays armed, producing one
+              completion per datagram, until it runs out of buffers or is cancelled (see close_udp_socket).
+*/
+void uring_arm_receive(mtp_uring *u, int fd)
+{
+    for (int k = 0; k < u->armed_count; k++)
+    {
+        if (u->armed[k] == fd)
+            return;
+    }
+    if (u->armed_count == SIZE_SM)
+        return;
+    u->armed[u->armed_count++] = fd;
+
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)&u->recv_msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (unsigned int)fd;
+    uring_queue(u);
+}
+
+/*
+    Function: uring_disarm
+    Arguments: mtp_uring *u, int fd
+    Return Value: void
+    Workflow: Forgets the multishot receive of UDP socket fd after its last completion, so that it is armed again.
+*/
+void uring_disarm(mtp_uring *u, int fd)
+{
+    for (int k = 0; k < u->armed_count; k++)
+    {
+        if (u->armed[k] == fd)
+        {
+            u->armed[k] = u->armed[--u->armed_count];
+            return;
+        }
+    }
+}
+
+/*
+    Function: uring_send_done
+    Arguments: mtp_uring *u, struct io_uring_cqe *cqe
+    Return Value: void
+    Workflow: Handles the completion of a send: a GSO send the kernel refused is sent again one datagram at a time,
+              and the slot is freed.
+*/
+void uring_send_done(mtp_uring *u, struct io_uring_cqe *cqe)
+{
+    int slot = (int)(cqe->user_data & ~URING_SEND_TAG);
+    uring_send *snd = &u->sends[slot];
+    if (cqe->res < 0 && snd->seg_size > 0 && cqe->res != -EAGAIN && cqe->res != -ENOBUFS)
+    {
+        errno = -cqe->res;
+        send_one_by_one(snd->fd, &snd->dest, snd->frame, snd->iov.iov_len, snd->seg_size);
+    }
+    u->free_sends[u->free_count++] = slot;
+}
+
+/*
+    Function: uring_reap_sends
+    Arguments: mtp_uring *u
+    Return Value: void
+    Workflow: Handles the completed sends of a ring that only sends (S_Thread).
+*/
+void uring_reap_sends(mtp_uring *u)
+{
+    unsigned int head = *u->cq_head;
+    unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+        if (cqe->user_data & URING_SEND_TAG)
+            uring_send_done(u, cqe);
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+    Function: close_udp_socket
+    Arguments: int fd
+    Return Value: int
+    Workflow: Closes a UDP socket of an MTP socket. With the io_uring backend, the multishot receive R_Thread has on it
+              holds a reference to the socket, which would keep it (and its port) open after close: it is cancelled
+              first, synchronously. uring_arm_lock keeps R_Thread from arming a new one between the cancel and the close.
+*/
+int close_udp_socket(int fd)
+{
+    pthread_mutex_lock(&uring_arm_lock);
+    if (r_uring_fd >= 0)
+    {
+        struct io_uring_sync_cancel_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.fd = fd;
+        reg.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        reg.timeout.tv_sec = -1;
+        reg.timeout.tv_nsec = -1;
+        syscall(__NR_io_uring_register, r_uring_fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1);
+    }
+    int ret = close(fd);
+    pthread_mutex_unlock(&uring_arm_lock);
+    return ret;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/*---------------------------------------MAIN THREAD----------------------------------------------------------*/
+#ifndef MTP_INPROC
+/*
+    Function: sigint_handler
+    Arguments: int signum
+    Return Value: void
+    Workflow: Signal handler for SIGINT signal. Sets the flag sigint_received to 1 indicating the signal is received.
+              It then cleans up the shared variables segment using shmctl, removes the name of the MTP table
+              of the instance and exits the process.
+*/
+void sigint_handler(int signum)
+{
+    if (signum == SIGINT)
+    {
+        sigint_received = 1;
+
+        shmctl(sm_id_shared_vars, 0, 0);
+        shm_unlink(table_name);
+        unlink(table_path);
+        exit(0);
+    }
+    return;
+}
+
+/*
+    Function: open_hugetlb_table
+    Arguments: size_t size, size_t *mapped
+    Return Value: void *
+    Workflow: Creates the MTP table as the file table_name on the hugetlbfs mount MTP_HUGETLBFS, sized to a multiple
+              of its huge page size (stored in *mapped), and maps it, which reserves the huge pages (see prefault_table
+              for faulting them in). Returns the mapping, or NULL (with the file removed) if there is no hugetlbfs
+              there or not enough huge pages are reserved (vm.nr_hugepages).
+*/
+void *open_hugetlb_table(size_t size, size_t *mapped)
+{
+    int fd = open(table_path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+        return NULL;
+
+    struct statfs fs;
+    void *addr = MAP_FAILED;
+    if (fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC)
+    {
+        *mapped = (size + fs.f_bsize - 1) / fs.f_bsize * fs.f_bsize;
+        if (ftruncate(fd, *mapped) == 0)
+            addr = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    else
+    {
+        errno = ENOTSUP;
+    }
+    int saved_errno = errno;
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        unlink(table_path);
+        errno = saved_errno;
+        return NULL;
+    }
+    return addr;
+}
+
+/*
+    Function: open_shm_table
+    Arguments: size_t size, size_t *mapped, int thp
+    Return Value: void *
+    Workflow: Creates (or reuses, as a restarted daemon did with the SysV segment) the POSIX shared memory object
+              table_name for the MTP table and maps it. With thp the object is rounded up to MTP_HUGE_PAGE and the
+              mapping advised MADV_HUGEPAGE before it is faulted in, so that the kernel backs it with transparent huge
+              pages if /sys/kernel/mm/transparent_hugepage/shmem_enabled allows it (advise or always). The pages are
+              faulted in afterwards by prefault_table. Returns NULL if it fails.
+*/
+void *open_shm_table(size_t size, size_t *mapped, int thp)
+{
+    size_t page = thp ? MTP_HUGE_PAGE : (size_t)getpagesize();
+    *mapped = (size + page - 1) / page * page;
+
+    int fd = shm_open(table_name, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+        return NULL;
+
+    void *addr = MAP_FAILED;
+    if (ftruncate(fd, *mapped) == 0)
+        addr = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int saved_errno = errno;
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        errno = saved_errno;
+        return NULL;
+    }
+
+    if (thp)
+    {
+        if (madvise(addr, *mapped, MADV_HUGEPAGE) < 0)
+            LOG(LOG_WARN, "madvise(MADV_HUGEPAGE): %s\n", strerror(errno));
+
+        char mode[128] = "";
+        FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+        if (f != NULL)
+        {
+            if (fgets(mode, sizeof(mode), f) == NULL)
+                mode[0] = '\0';
+            fclose(f);
+        }
+        if (strstr(mode, "[never]") != NULL || strstr(mode, "[deny]") != NULL)
+            LOG(LOG_WARN, "Transparent huge pages are off for shared memory (shmem_enabled: %s)\n", strtok(mode, "\n"));
+    }
+    return addr;
+}
+
+/*
+    Function: bind_table_node
+    Arguments: void *addr, size_t mapped
+    Return Value: void
+    Workflow: If the environment variable MTP_NUMA_NODE is set, binds the memory of the MTP table to that NUMA node
+              (mbind with MPOL_BIND) before it is faulted in. The policy belongs to the shared memory object, so the
+              pages stay on the node whichever process touches them; the R and S threads and the clients should run
+              on CPUs of the same node (MTP_CPU_R, MTP_CPU_S, numactl or taskset). A failure is logged and the table
+              is left to the default policy.
+*/
+void bind_table_node(void *addr, size_t mapped)
+{
+    char *env = getenv("MTP_NUMA_NODE");
+    if (env == NULL || env[0] == '\0')
+        return;
+
+    char *end;
+    long node = strtol(env, &end, 10);
+    if (end == env || *end != '\0' || node < 0 || node >= MAX_CPUS)
+    {
+        LOG(LOG_WARN, "MTP_NUMA_NODE: invalid node %s\n", env);
+        return;
+    }
+    const int bits = 8 * sizeof(unsigned long);
+    unsigned long nodes[MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+    nodes[node / bits] = 1UL << (node % bits);
+    // maxnode counts one more than the bits of the mask, as in the libnuma calls
+    if (syscall(SYS_mbind, addr, mapped, MPOL_BIND, nodes, MAX_CPUS + 1, MPOL_MF_STRICT | MPOL_MF_MOVE) < 0)
+        LOG(LOG_WARN, "MTP table on NUMA node %ld: %s\n", node, strerror(errno));
+    else
+        LOG(LOG_INFO, "MTP table bound to NUMA node %ld\n", node);
+}
+
+/*
+    Function: prefault_table
+    Arguments: void *addr, size_t mapped
+    Return Value: void
+    Workflow: Faults in every page of the MTP table now, once its NUMA policy and huge page advice are set, so that
+              neither the daemon threads nor the clients take page faults on it later (MAP_POPULATE would fault it
+              in before mbind and madvise could apply).
+*/
+void prefault_table(void *addr, size_t mapped)
+{
+    for (size_t off = 0; off < mapped; off += getpagesize())
+    {
+        volatile char *p = (volatile char *)addr + off;
+        *p = *p;
+    }
+}
+
+/*
+    Function: create_shared_MTP_Table
+    Arguments: None
+    Return Value: mtp_socket *
+    Workflow: Creates the MTP table with the backing chosen by the environment variable MTP_HUGEPAGES: a file on
+              hugetlbfs ("hugetlb"), POSIX shared memory with transparent huge pages ("thp") or with 4 KB pages
+              (unset), falling back to 4 KB pages if huge pages are not available, bound to the NUMA node
+              MTP_NUMA_NODE if it is set, and faults it in. The name of the other backing is
+              removed so that the processes find this table (see mtp_table_open). The header is filled in, except
+              for magic, which main sets once the table is initialized, and the mapping is adopted as the one of this
+              process. Exits if the table can not be created.
+*/
+mtp_socket *create_shared_MTP_Table()
+{
+    char *env = getenv("MTP_HUGEPAGES");
+    int backing = TABLE_SHM;
+    if (env != NULL && strcmp(env, "hugetlb") == 0)
+        backing = TABLE_HUGETLB;
+    else if (env != NULL && strcmp(env, "thp") == 0)
+        backing = TABLE_THP;
+
+    size_t mapped = 0;
+    void *addr = NULL;
+    if (backing == TABLE_HUGETLB)
+    {
+        addr = open_hugetlb_table(sizeof(mtp_shared_table), &mapped);
+        if (addr == NULL)
+        {
+            LOG(LOG_WARN, "Huge pages on %s: %s, using 4 KB pages\n", MTP_HUGETLBFS, strerror(errno));
+            backing = TABLE_SHM;
+        }
+        else
+        {
+            shm_unlink(table_name);
+        }
+    }
+    if (backing != TABLE_HUGETLB)
+    {
+        unlink(table_path);
+        addr = open_shm_table(sizeof(mtp_shared_table), &mapped, backing == TABLE_THP);
+        if (addr == NULL)
+        {
+            LOG(LOG_ERROR, "MTP table %s: %s\n", table_name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    bind_table_node(addr, mapped);
+    prefault_table(addr, mapped);
+
+    mtp_shared_table *shared = (mtp_shared_table *)addr;
+    __atomic_store_n(&shared->header.magic, 0, __ATOMIC_RELEASE);
+    shared->header.version = MTP_TABLE_VERSION;
+    shared->header.size = sizeof(mtp_shared_table);
+    shared->header.mapped = mapped;
+    shared->header.backing = backing;
+    mtp_table_adopt(shared);
+
+    static const char *backing_names[] = {"4 KB pages", "transparent huge pages", "hugetlbfs"};
+    LOG(LOG_INFO, "MTP table %s: %zu bytes, %s\n", table_name, mapped, backing_names[backing]);
+    return shared->sockets;
+}
+
+/*
+    Function: create_shared_variables
+    Arguments: None
+    Return Value: shared_variables *
+    Workflow: Creates a shared memory segment for shared variables.
+              It first generates the key of KEY_SHARED_RESOURCE for the instance (MTP_INSTANCE) using mtp_ipc_key.
+              Then it obtains a shared memory identifier using shmget function with the generated key,
+              allocating memory for the size of shared_variables structure.
+              Finally, it attaches the shared memory segment to the process address space using shmat
+              and returns a pointer to the shared variables.
+*/
+shared_variables *create_shared_variables()
+{
+    int sm_key = mtp_ipc_key(KEY_SHARED_RESOURCE);
+    int sm_id_shared_vars = shmget(sm_key, sizeof(shared_variables), 0777 | IPC_CREAT);
+    shared_variables *vars = (shared_variables *)shmat(sm_id_shared_vars, 0, 0);
+    return vars;
+}
+
+/*
+    Function: create_entry_semaphore
+    Arguments: int *id
+    Return Value: void
+    Workflow: Creates a semaphore for entry synchronization.
+              It first generates the key of KEY_ENTRY_SEM for the instance (MTP_INSTANCE) using mtp_ipc_key.
+              Then it obtains a semaphore identifier using semget function with the generated key,
+              creating a new semaphore if it does not exist, and setting the permission to 0777 | IPC_CREAT.
+              Afterward, it initializes the semaphore value to 0 using semctl.
+*/
+void create_entry_semaphore(int *id)
+{
+    int sm_key = mtp_ipc_key(KEY_ENTRY_SEM);
+    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
+    semctl(*id, 0, SETVAL, 0);
+}
+
+/*
+    Function: create_exit_semaphore
+    Arguments: int *id
+    Return Value: void
+    Workflow: Creates a semaphore for exit synchronization.
+              It first generates the key of KEY_EXIT_SEM for the instance (MTP_INSTANCE) using mtp_ipc_key.
+              Then it obtains a semaphore identifier using semget function with the generated key,
+              creating a new semaphore if it does not exist, and setting the permission to 0777 | IPC_CREAT.
+              Afterward, it initializes the semaphore value to 0 using semctl.
+*/
+void create_exit_semaphore(int *id)
+{
+    int sm_key = mtp_ipc_key(KEY_EXIT_SEM);
+    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
+    semctl(*id, 0, SETVAL, 0);
+}
+
+/*
+    Function: create_mtx_table_info
+    Arguments: int *id
+    Return Value: void
+    Workflow: Creates the mutex for controlling access to the MTP table information.
+              It initializes the robust process-shared mutex of LOCK_TABLE_INFO in the MTP table segment with lock_init
+              (see locks.c), so that the lock is available, and stores the lock id in the provided pointer.
+*/
+void create_mtx_table_info(int *id)
+{
+    lock_init(LOCK_TABLE_INFO);
+    *id = LOCK_TABLE_INFO;
+}
+
+/*
+    Function: create_mutex_swnd
+    Arguments: int *id
+    Return Value: void
+    Workflow: Creates the mutex for controlling access to the send window.
+              It initializes the robust process-shared mutex of LOCK_SWND in the MTP table segment with lock_init
+              (see locks.c), so that the lock is available, and stores the lock id in the provided pointer.
+*/
+void create_mutex_swnd(int *id)
+{
+    lock_init(LOCK_SWND);
+    *id = LOCK_SWND;
+}
+
+/*
+    Function: create_mutex_recvbuf
+    Arguments: int *id
+    Return Value: void
+    Workflow: Creates the mutex for controlling access to the receive buffer.
+              It initializes the robust process-shared mutex of LOCK_RECVBUF in the MTP table segment with lock_init
+              (see locks.c), so that the lock is available, and stores the lock id in the provided pointer.
+*/
+void create_mutex_recvbuf(int *id)
+{
+    lock_init(LOCK_RECVBUF);
+    *id = LOCK_RECVBUF;
+}
+
+/*
+    Function: create_mutex_sendbuf
+    Arguments: int *id
+    Return Value: void
+    Workflow: Creates the mutex for controlling access to the send buffer.
+              It initializes the robust process-shared mutex of LOCK_SENDBUF in the MTP table segment with lock_init
+              (see locks.c), so that the lock is available, and stores the lock id in the provided pointer.
+*/
+void create_mutex_sendbuf(int *id)
+{
+    lock_init(LOCK_SENDBUF);
+    *id = LOCK_SENDBUF;
+}
+#endif
+
+/*
+    Function: find_udp_sharer
+    Arguments: mtp_socket *MTP_Table, int i, struct sockaddr_in *src_addr
+    Return Value: int
+    Workflow: With STREAM_MUX, looks for another MTP socket already bound to src_addr, whose UDP socket socket i can
+              share. Returns its index, -1 if there is none (or STREAM_MUX is off) and socket i must bind its own
+              UDP socket, or -2 if one of them already has the same destination and stream id as socket i.
+*/
+int find_udp_sharer(mtp_socket *MTP_Table, int i, struct sockaddr_in *src_addr)
+{
+    if (!STREAM_MUX)
+        return -1;
+
+    int sharer = -1;
+    for_each_socket(j, &MTP_SHARED(MTP_Table)->active)
+    {
+        if (j == i || MTP_Table[j].free || MTP_Table[j].src_addr.sin_port != src_addr->sin_port ||
+            MTP_Table[j].src_addr.sin_addr.s_addr != src_addr->sin_addr.s_addr)
+            continue;
+        if (MTP_Table[j].stream_id == MTP_Table[i].stream_id && MTP_Table[j].dest_port == MTP_Table[i].dest_port &&
+            strcmp(MTP_Table[j].dest_ip, MTP_Table[i].dest_ip) == 0)
+            return -2;
+        sharer = j;
+    }
+    return sharer;
+}
+
+/*
+    Function: release_udp_socket
+    Arguments: mtp_socket *MTP_Table, int i
+    Return Value: int
+    Workflow: Closes the UDP socket of MTP socket i, unless another active MTP socket shares it (STREAM_MUX).
+              Returns the result of close, or 0 if the UDP socket stays open.
+*/
+int release_udp_socket(mtp_socket *MTP_Table, int i)
+{
+    for_each_socket(j, &MTP_SHARED(MTP_Table)->active)
+    {
+        if (j != i && !MTP_Table[j].free && MTP_Table[j].udp_sockid == MTP_Table[i].udp_sockid)
+            return 0;
+    }
+    return close_udp_socket(MTP_Table[i].udp_sockid);
+}
+
+/*
+    Function: reset_windows
+    Arguments: mtp_socket *MTP_Table, int i
+    Return Value: void
+    Workflow: Empties the send and receive buffers of MTP socket i and resets its send and receive windows,
+              taking the window and buffer locks.
+*/
+void reset_windows(mtp_socket *MTP_Table, int i)
+{
+    mtp_buffers *MTP_Buff = MTP_BUFFERS(MTP_Table);
+
+    down(mtx_swnd);
+    down(mtx_sendbuf);
+    for (int k = 0; k < SEND_BUFFSIZE; k++)
+    {
+        MTP_Buff[i].send_buff[k].sequence_no = -1;
+    }
+    MTP_Table[i].swnd.left_idx = 0;
+    MTP_Table[i].swnd.right_idx = (RECV_BUFFSIZE - 1) % SEND_BUFFSIZE;
+    MTP_Table[i].swnd.new_entry = 0;
+    MTP_Table[i].swnd.last_seq_no = 0;
+    MTP_Table[i].swnd.last_sent = -1;
+    MTP_Table[i].swnd.last_ack_seqno = 0;
+    for (int k = 0; k < SEND_BUFFSIZE; k++)
+    {
+        MTP_Table[i].swnd.last_sent_ns[k] = 0;
+    }
+    up(mtx_sendbuf);
+    up(mtx_swnd);
+
+    down(mtx_recvbuf);
+    for (int k = 0; k < RECV_BUFFSIZE; k++)
+    {
+        MTP_Buff[i].recv_buff[k].sequence_no = rwnd_free_mark(k);
+    }
+    MTP_Table[i].rwnd.inserted = 0;
+    MTP_Table[i].rwnd.consumed = 0;
+    MTP_Table[i].rwnd.nospace = 0;
+    MTP_Table[i].rwnd.last_inorder_received = 0;
+    socket_set_remove(&MTP_SHARED(MTP_Table)->readable, i);
+    socket_set_add(&MTP_SHARED(MTP_Table)->writable, i);
+    up(mtx_recvbuf);
+}
+
+/*
+    Function: unwatch_owner
+    Arguments: int i
+    Return Value: void
+    Workflow: Closes the pidfd of the owner of MTP socket i, if any. The caller holds mtx_table_info.
+*/
+void unwatch_owner(int i)
+{
+    if (owner_pidfd[i] >= 0)
+    {
+        close(owner_pidfd[i]);
+        owner_pidfd[i] = -1;
+    }
+}
+
+/*
+    Function: watch_owner
+    Arguments: mtp_socket *MTP_Table, int i
+    Return Value: void
+    Workflow: Opens a pidfd on the process owning MTP socket i and wakes G_Thread to add it to the descriptors it polls,
+              so that the socket is reclaimed as soon as the process exits. If pidfd_open is not available the socket is
+              left to the kill() check of G_Thread every GARBAGE_T seconds. The caller holds mtx_table_info.
+*/
+void watch_owner(mtp_socket *MTP_Table, int i)
+{
+    unwatch_owner(i);
+    linger_since[i] = 0;
+#ifdef SYS_pidfd_open
+    int saved_errno = errno;
+    owner_pidfd[i] = syscall(SYS_pidfd_open, MTP_Table[i].pid, 0);
+    errno = saved_errno;
+#endif
+    if (owner_pidfd[i] >= 0 && g_wakeup_fd >= 0)
+    {
+        unsigned long long one = 1;
+        if (write(g_wakeup_fd, &one, sizeof(one)) < 0)
+            LOG(LOG_WARN, "G Thread wakeup: %s\n", strerror(errno));
+    }
+}
+
+/*
+    Function: forget_peer
+    Arguments: mtp_socket *MTP_Table, int i
+    Return Value: void
+    Workflow: If MTP socket i is the peer of a server socket, removes it from the peer hash table. The caller holds mtx_table_info.
+*/
+void forget_peer(mtp_socket *MTP_Table, int i)
+{
+    int server = MTP_Table[i].server;
+    if (server < 0 || server == i)
+        return;
+
+    struct sockaddr_in peer_addr = sock_converter(MTP_Table[i].dest_ip, MTP_Table[i].dest_port);
+    peer_hash_remove(MTP_SHARED(MTP_Table)->peers, server, peer_addr.sin_addr.s_addr, peer_addr.sin_port);
+    MTP_Table[i].server = -1;
+}
+
+/*
+    Function: close_peers
+    Arguments: mtp_socket *MTP_Table, int server
+    Return Value: void
+    Workflow: Frees the MTP sockets of all peers of a server socket that is being closed, dropping their buffered messages.
+              They share its UDP socket, so nothing is closed. The caller holds mtx_table_info.
+*/
+void close_peers(mtp_socket *MTP_Table, int server)
+{
+    for_each_socket(j, &MTP_SHARED(MTP_Table)->active)
+    {
+        if (j == server || MTP_Table[j].free || MTP_Table[j].server != server)
+            continue;
+        forget_peer(MTP_Table, j);
+        unwatch_owner(j);
+        reset_windows(MTP_Table, j);
+        MTP_Table[j].free = 1;
+        socket_set_remove(&MTP_SHARED(MTP_Table)->active, j);
+        socket_set_remove(&MTP_SHARED(MTP_Table)->pending_send, j);
+    }
+}
+
+/*
+    Function: process_request
+    Arguments: mtp_socket *MTP_Table, shared_variables *shared_resource
+    Return Value: void
+    Workflow: Performs the socket operation (creation, binding, closing, impairment setting or listening) requested in shared_resource->status
+              on the UDP socket of shared_resource->mtp_id and fills in the return value and error number.
+              errno is cleared first so that a stale value is never reported for a successful call.
+*/
+void process_request(mtp_socket *MTP_Table, shared_variables *shared_resource)
+{
+    int socket_id;
+
+    shared_resource->error_no = 0;
+    errno = 0;
+    /* Respond to socket creation call */
+    if (shared_resource->status == 0)
+    {
+        socket_id = socket(AF_INET, SOCK_DGRAM, 0);
+        MTP_Table[shared_resource->mtp_id].udp_sockid = socket_id;
+        memset(&MTP_Table[shared_resource->mtp_id].src_addr, 0, sizeof(struct sockaddr_in));
+        shared_resource->return_value = socket_id;
+        shared_resource->error_no = errno;
+        if (socket_id >= 0)
+        {
+            enable_gro(socket_id);
+            enable_timestamps(socket_id);
+            MTP_Table[shared_resource->mtp_id].stream_id = 0;
+            MTP_Table[shared_resource->mtp_id].compress = 0;
+            MTP_Table[shared_resource->mtp_id].weight = 1;
+            MTP_Table[shared_resource->mtp_id].server = -1;
+            MTP_Table[shared_resource->mtp_id].next_peer = 0;
+            MTP_Table[shared_resource->mtp_id].poller = -1;
+            socket_set_remove(&MTP_SHARED(MTP_Table)->readable, shared_resource->mtp_id);
+            socket_set_add(&MTP_SHARED(MTP_Table)->writable, shared_resource->mtp_id);
+            memset(&MTP_Table[shared_resource->mtp_id].stats, 0, sizeof(mtp_stats));
+            memset(&MTP_Table[shared_resource->mtp_id].impair, 0, sizeof(impair_config));
+            MTP_Table[shared_resource->mtp_id].impair.loss = P;
+            impair_reset(MTP_Table, shared_resource->mtp_id);
+            watch_owner(MTP_Table, shared_resource->mtp_id);
+            socket_set_add(&MTP_SHARED(MTP_Table)->active, shared_resource->mtp_id);
+        }
+    }
+    /* Respond to bind call */
+    else if (shared_resource->status == 1)
+    {
+        socket_id = MTP_Table[shared_resource->mtp_id].udp_sockid;
+        int sharer = find_udp_sharer(MTP_Table, shared_resource->mtp_id, &shared_resource->src_addr);
+        if (sharer == -2)
+        {
+            shared_resource->return_value = -1;
+            errno = EADDRINUSE;
+        }
+        else if (sharer >= 0)
+        {
+            // Stream multiplexing: use the UDP socket already bound to this address
+            close_udp_socket(socket_id);
+            MTP_Table[shared_resource->mtp_id].udp_sockid = MTP_Table[sharer].udp_sockid;
+            shared_resource->return_value = 0;
+        }
+        else
+        {
+            shared_resource->return_value = bind(socket_id, (const struct sockaddr *)&(shared_resource->src_addr), sizeof(shared_resource->src_addr));
+        }
+        shared_resource->error_no = errno;
+        if (shared_resource->return_value == 0)
+        {
+            MTP_Table[shared_resource->mtp_id].src_addr = shared_resource->src_addr;
+        }
+    }
+    /* Respond to close call */
+    else if (shared_resource->status == 2)
+    {
+        if (MTP_Table[shared_resource->mtp_id].server == shared_resource->mtp_id)
+        {
+            close_peers(MTP_Table, shared_resource->mtp_id);
+        }
+        shared_resource->return_value = release_udp_socket(MTP_Table, shared_resource->mtp_id);
+        shared_resource->error_no = errno;
+        if (shared_resource->return_value == 0)
+        {
+            unwatch_owner(shared_resource->mtp_id);
+            socket_set_remove(&MTP_SHARED(MTP_Table)->active, shared_resource->mtp_id);
+            socket_set_remove(&MTP_SHARED(MTP_Table)->pending_send, shared_resource->mtp_id);
+        }
+    }
+    /* Respond to impairment setting call */
+    else if (shared_resource->status == 3)
+    {
+        MTP_Table[shared_resource->mtp_id].impair = shared_resource->impair;
+        impair_reset(MTP_Table, shared_resource->mtp_id);
+        shared_resource->return_value = 0;
+    }
+    /* Respond to listen call */
+    else if (shared_resource->status == 4)
+    {
+        if (MTP_Table[shared_resource->mtp_id].src_addr.sin_port == 0 || MTP_Table[shared_resource->mtp_id].server >= 0)
+        {
+            shared_resource->return_value = -1;
+            shared_resource->error_no = EINVAL;
+        }
+        else
+        {
+            MTP_Table[shared_resource->mtp_id].server = shared_resource->mtp_id;
+            MTP_Table[shared_resource->mtp_id].next_peer = 0;
+            MTP_Table[shared_resource->mtp_id].dest_ip[0] = '\0';
+            MTP_Table[shared_resource->mtp_id].dest_port = 0;
+            shared_resource->return_value = 0;
+        }
+    }
+    shared_resource->status = -1;
+}
+
+#ifndef MTP_INPROC
+/*
+    Function: socket_handler
+    Arguments: mtp_socket *MTP_Table, shared_variables *shared_resource, int *entry_sem, int *exit_sem
+    Return Value: void
+    Workflow: Handles socket operations such as creation, binding, and closing in response to requests from user processes.
+              It continuously waits for requests by blocking on the entry semaphore.
+              Upon receiving a request, it performs the appropriate socket operation through process_request,
+              unless it has already served that request number (signalled again after its process died, see locks.c).
+              After processing, it signals the user process by releasing the exit semaphore.
+*/
+void socket_handler(mtp_socket *MTP_Table, shared_variables *shared_resource, int *entry_sem, int *exit_sem)
+{
+    /* The main thread(after creating R and S) for the rest of its lifetime
+    server the user processes for creating, binding and closing the sockets */
+
+    LOG(LOG_INFO, "Main Thread ready to go...\n");
+    while (1)
+    {
+        sem_down(*entry_sem);
+        unsigned int request_no = __atomic_load_n(&shared_resource->request_no, __ATOMIC_ACQUIRE);
+        if (request_no != shared_resource->reply_no)
+        {
+            process_request(MTP_Table, shared_resource);
+            __atomic_store_n(&shared_resource->reply_no, request_no, __ATOMIC_RELEASE);
+        }
+        sem_up(*exit_sem);
+    }
+}
+#endif
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/*----------------------------------------------------R THREAD----------------------------------------------------------*/
+
+/*
+    Function: poll_wake
+    Arguments: mtp_socket *MTP_Table, int i
+    Return Value: void
+    Workflow: Wakes the process that last waited in m_poll on MTP socket i, if any: increments the sequence number of its
+              poller slot and, if one of its threads is blocked on it, wakes it with FUTEX_WAKE.
+*/
+void poll_wake(mtp_socket *MTP_Table, int i)
+{
+    int slot = MTP_Table[i].poller;
+    if (slot < 0 || slot >= MAX_POLLERS)
+        return;
+
+    poll_waiter *w = &MTP_SHARED(MTP_Table)->pollers[slot];
+    __atomic_fetch_add(&w->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->waiting, __ATOMIC_SEQ_CST) > 0)
+        syscall(SYS_futex, &w->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+    Function: mark_ready
+    Arguments: mtp_socket *MTP_Table, socket_set *set, int i
+    Return Value: void
+    Workflow: Adds MTP socket i to a readiness set (readable or writable) and wakes its poller. A peer of a server socket
+              makes the server socket ready too, since m_recvfrom on the server socket reads from its peers.
+*/
+void mark_ready(mtp_socket *MTP_Table, socket_set *set, int i)
+{
+    // The slot that made the socket ready is stored before it is added (see clear_ready in msocket.c)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    socket_set_add(set, i);
+    poll_wake(MTP_Table, i);
+
+    int server = MTP_Table[i].server;
+    if (server >= 0 && server != i)
+    {
+        socket_set_add(set, server);
+        if (MTP_Table[server].poller != MTP_Table[i].poller)
+            poll_wake(MTP_Table, server);
+    }
+}
+
+/*
+    Function: find_local_peer
+    Arguments: mtp_socket *MTP_Table, int i
+    Return Value: int
+    Workflow: Looks for another MTP socket of this daemon bound to the destination address of socket i
+              whose own destination is the address socket i is bound to. Returns its index, or -1 if
+              the peer is not local (or LOCAL_FASTPATH is disabled) and frames must go over UDP. Sockets whose
+              impairment holds frames back (delay, reordering, duplication, rate limit) also go over UDP so that
+              R_Thread can apply it; the fast path only applies the loss model.
+*/
+int find_local_peer(mtp_socket *MTP_Table, int i)
+{
+    if (!LOCAL_FASTPATH || MTP_Table[i].src_addr.sin_port == 0 || impair_holds_frames(MTP_Table, i))
+        return -1;
+
+    struct sockaddr_in dest_addr = sock_converter(MTP_Table[i].dest_ip, MTP_Table[i].dest_port);
+    for_each_socket(j, &MTP_SHARED(MTP_Table)->active)
+    {
+        if (j == i || MTP_Table[j].free || MTP_Table[j].src_addr.sin_port != dest_addr.sin_port || impair_holds_frames(MTP_Table, j))
+            continue;
+        if (MTP_Table[j].src_addr.sin_addr.s_addr != dest_addr.sin_addr.s_addr && MTP_Table[j].src_addr.sin_addr.s_addr != htonl(INADDR_ANY))
+            continue;
+
+        struct sockaddr_in peer_dest = sock_converter(MTP_Table[j].dest_ip, MTP_Table[j].dest_port);
+        if (peer_dest.sin_port == MTP_Table[i].src_addr.sin_port &&
+            (peer_dest.sin_addr.s_addr == MTP_Table[i].src_addr.sin_addr.s_addr || MTP_Table[i].src_addr.sin_addr.s_addr == htonl(INADDR_ANY)))
+        {
+            return j;
+        }
+    }
+    return -1;
+}
+
+/*
+    Function: rtt_sample
+    Arguments: mtp_socket *MTP_Table, int i, long long sample_ns
+    Return Value: void
+    Workflow: Adds an RTT sample of socket i to its statistics: the smoothed RTT and mean deviation (gains 1/8 and
+              1/4, as TCP does) and the smallest sample. A negative sample (the wall clock, in which the kernel stamps
+              arrivals, was stepped) is ignored.
+*/
+void rtt_sample(mtp_socket *MTP_Table, int i, long long sample_ns)
+{
+    if (sample_ns < 0)
+        return;
+    unsigned long long sample_us = sample_ns / 1000;
+    unsigned long long rtt_us = __atomic_load_n(&MTP_Table[i].stats.rtt_us, __ATOMIC_RELAXED);
+    unsigned long long var_us = __atomic_load_n(&MTP_Table[i].stats.rtt_var_us, __ATOMIC_RELAXED);
+    unsigned long long min_us = __atomic_load_n(&MTP_Table[i].stats.rtt_min_us, __ATOMIC_RELAXED);
+    if (rtt_us == 0)
+    {
+        rtt_us = sample_us;
+        var_us = sample_us / 2;
+    }
+    else
+    {
+        unsigned long long dev_us = (sample_us > rtt_us) ? sample_us - rtt_us : rtt_us - sample_us;
+        var_us = (3 * var_us + dev_us) / 4;
+        rtt_us = (7 * rtt_us + sample_us) / 8;
+    }
+    if (min_us == 0 || sample_us < min_us)
+        min_us = sample_us;
+    __atomic_store_n(&MTP_Table[i].stats.rtt_us, rtt_us, __ATOMIC_RELAXED);
+    __atomic_store_n(&MTP_Table[i].stats.rtt_var_us, var_us, __ATOMIC_RELAXED);
+    __atomic_store_n(&MTP_Table[i].stats.rtt_min_us, min_us, __ATOMIC_RELAXED);
+}
+
+/*
+    Function: update_swnd_on_ack
+    Arguments: mtp_socket *MTP_Table, int i, int ack_seqno, int curr_empty_space
+    Return Value: void
+    Workflow: Processes an ACK for socket i. The caller holds mtx_swnd and mtx_sendbuf.
+              A duplicate ACK (same sequence number and same advertised space) is ignored.
+              Otherwise the acknowledged messages are removed from the send buffer (their send time cleared, so that
+              the message m_sendto puts in the slot next is not taken for a retransmission) and the send window
+              is moved to start after them, sized by the empty space advertised by the receiver, and S_Thread is woken
+              to send what the window now allows.
+*/
+void update_swnd_on_ack(mtp_socket *MTP_Table, int i, int ack_seqno, int curr_empty_space)
+{
+    mtp_buffers *MTP_Buff = MTP_BUFFERS(MTP_Table);
+    send_window curr_swnd = MTP_Table[i].swnd;
+    int last_ack_seqno = curr_swnd.last_ack_seqno;
+
+    int flag_dup_seq_ack = 0;
+    if (max_logical(last_ack_seqno, ack_seqno, MAX_SEQ_NO) == last_ack_seqno && curr_swnd.last_ack_emptyspace == curr_empty_space)
+    {
+        // Duplicate ACK received
+        STAT_ADD(MTP_Table[i], dup_acks, 1);
+        return;
+    }
+    if (max_logical(last_ack_seqno, ack_seqno, MAX_SEQ_NO) == last_ack_seqno && curr_swnd.last_ack_emptyspace != curr_empty_space)
+    {
+        flag_dup_seq_ack = 1;
+    }
+
+    // Update the send window upon receiving valid ACK
+    int k = MTP_Table[i].swnd.left_idx;
+    int passed_last_sent = 0;
+    if (flag_dup_seq_ack == 0)
+    {
+        while (MTP_Buff[i].send_buff[k].sequence_no != ack_seqno)
+        {
+            slot_set(&MTP_Buff[i].send_buff[k], -1);
+            MTP_Table[i].swnd.last_sent_ns[k] = 0;
+            passed_last_sent |= (k == MTP_Table[i].swnd.last_sent);
+            k = (k + 1) % SEND_BUFFSIZE;
+        }
+        slot_set(&MTP_Buff[i].send_buff[k], -1);
+        MTP_Table[i].swnd.last_sent_ns[k] = 0;
+        passed_last_sent |= (k == MTP_Table[i].swnd.last_sent);
+
+        // RTT sample, only if the acknowledged message was sent once (Karn's rule)
+        if (MTP_Table[i].swnd.first_sent_ns[k] != 0)
+        {
+            rtt_sample(MTP_Table, i, (long long)(frame_time_ns() - MTP_Table[i].swnd.first_sent_ns[k]));
+            MTP_Table[i].swnd.first_sent_ns[k] = 0;
+        }
+        k = (k + 1) % SEND_BUFFSIZE;
+    }
+
+    // The receiver can acknowledge frames it buffered beyond what this window last sent (after a retransmission
+    // restarted last_sent at left_idx): never leave last_sent behind left_idx, or S_Thread would stop sending
+    if (passed_last_sent)
+    {
+        MTP_Table[i].swnd.last_sent = (k - 1 + SEND_BUFFSIZE) % SEND_BUFFSIZE;
+    }
+
+    MTP_Table[i].swnd.left_idx = k;
+    MTP_Table[i].swnd.right_idx = (k + curr_empty_space - 1 + SEND_BUFFSIZE) % SEND_BUFFSIZE;
+    // An older ACK (e.g. reordered between UDP and the local fast path) must not move last_ack_seqno back
+    MTP_Table[i].swnd.last_ack_seqno = flag_dup_seq_ack ? last_ack_seqno : ack_seqno;
+    MTP_Table[i].swnd.last_ack_emptyspace = curr_empty_space;
+
+    // m_sendto moves new_entry without a lock: the freed slots are stored before it is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int new_entry = __atomic_load_n(&MTP_Table[i].swnd.new_entry, __ATOMIC_RELAXED);
+    if (flag_dup_seq_ack == 0 && slot_seq(&MTP_Buff[i].send_buff[new_entry]) == -1)
+    {
+        mark_ready(MTP_Table, &MTP_SHARED(MTP_Table)->writable, i);
+    }
+    send_wake(&MTP_SHARED(MTP_Table)->send_waiter);
+}
 
-/*---------------------------------------MAIN THREAD----------------------------------------------------------*/
 /*
-    Function: sigint_handler
-    Arguments: int signum
+    Function: receive_data
+    Arguments: mtp_socket *MTP_Table, int i, char *udp_data, char *ACK_data_udp
     Return Value: void
-    Workflow: Signal handler for SIGINT signal. Sets the flag sigint_received to 1 indicating the signal is received.
-              It then cleans up shared memory segments using shmctl and exits the process.
+    Workflow: Processes a data frame for socket i. The caller holds mtx_recvbuf.
+              The receive buffer is a ring whose head slot holds the message after the last one m_recvfrom took, so
+              the frame goes to the slot at its distance from that message, if that is within the buffer and the
+              slot is free for it (m_recvfrom may have moved on meanwhile, see BUFFER RINGS in msocket.h).
+              The data is written before the sequence number is stored, which hands the message to m_recvfrom.
+              The last in-order sequence number is then advanced over the filled slots and the empty space is
+              taken from the inserted and consumed counters, so the work does not depend on the window size.
+              The 3-byte ACK to send back is written to ACK_data_udp and the nospace flag is updated.
 */
-void sigint_handler(int signum)
+void receive_data(mtp_socket *MTP_Table, int i, char *udp_data, char *ACK_data_udp)
 {
-    if (signum == SIGINT)
+    mtp_buffers *MTP_Buff = MTP_BUFFERS(MTP_Table);
+    // Insert the user data in its slot of the receive ring if the sequence number is in the receive window
+    int new_data_received = 0;
+    int seq_no = (int)(udp_data[1] - 'a');
+    unsigned long long consumed = __atomic_load_n(&MTP_Table[i].rwnd.consumed, __ATOMIC_ACQUIRE);
+    int last_taken = rwnd_last_taken(consumed);
+    int head = rwnd_head(consumed);
+    int dist = (seq_no - last_taken - 1 + MAX_SEQ_NO) % MAX_SEQ_NO;
+    if (dist < RECV_BUFFSIZE)
     {
-        sigint_received = 1;
+        int slot = (head + dist) % RECV_BUFFSIZE;
+        if (slot_seq(&MTP_Buff[i].recv_buff[slot]) == -seq_no)
+        {
+            // put data in receive buffer
+            new_data_received = 1;
+            my_strcpy(MTP_Buff[i].recv_buff[slot].data, udp_data + 2, KB);
+            slot_set(&MTP_Buff[i].recv_buff[slot], seq_no);
+            MTP_Table[i].rwnd.inserted++;
+            STAT_ADD(MTP_Table[i], msgs_received, 1);
+            STAT_ADD(MTP_Table[i], bytes_received, KB);
+        }
+    }
+    if (!new_data_received)
+    {
+        STAT_ADD(MTP_Table[i], discarded, 1);
+    }
+    else if (slot_seq(&MTP_Buff[i].recv_buff[head]) > 0)
+    {
+        mark_ready(MTP_Table, &MTP_SHARED(MTP_Table)->readable, i);
+    }
 
-        shmctl(sm_id_shared_vars, 0, 0);
-        shmctl(sm_id_MTP_Table, 0, 0);
-        exit(0);
+    // Advance the last in-order sequence number over the slots that are now filled
+    int in_order = (MTP_Table[i].rwnd.last_inorder_received - last_taken + MAX_SEQ_NO) % MAX_SEQ_NO;
+    while (in_order < RECV_BUFFSIZE && slot_seq(&MTP_Buff[i].recv_buff[(head + in_order) % RECV_BUFFSIZE]) > 0)
+    {
+        MTP_Table[i].rwnd.last_inorder_received = (MTP_Table[i].rwnd.last_inorder_received) % MAX_SEQ_NO + 1;
+        in_order++;
+    }
+
+    int empty_space = RECV_BUFFSIZE - (int)(MTP_Table[i].rwnd.inserted - consumed);
+
+    //*******************************
+    // First message received after sending special ACK for having space after nospace flag has been set
+    if (empty_space != 0 && MTP_Table[i].rwnd.nospace == 1 && new_data_received)
+    {
+        MTP_Table[i].rwnd.nospace = 0;
+    }
+    //*******************************
+
+    // Build the ACK
+    ACK_data_udp[0] = 'A';
+    ACK_data_udp[1] = (char)(MTP_Table[i].rwnd.last_inorder_received + 'a');
+    ACK_data_udp[2] = (char)(empty_space + 'a');
+
+    if (empty_space == 0)
+    {
+        MTP_Table[i].rwnd.nospace = 1;
+        STAT_ADD(MTP_Table[i], rwnd_full, 1);
     }
-    return;
 }
 
 /*
-    Function: create_shared_MTP_Table
-    Arguments: None
-    Return Value: mtp_socket *
-    Workflow: Creates a shared memory segment for the MTP table.
-              It first generates a key using ftok function based on the current directory and KEY_MTP_TABLE.
-              Then it obtains a shared memory identifier using shmget function with the generated key,
-              allocating memory for SIZE_SM number of mtp_socket structures.
-              Finally, it attaches the shared memory segment to the process address space using shmat
-              and returns a pointer to the MTP table.
+    Function: refresh_rwnd
+    Arguments: mtp_socket *MTP_Table, int i, char *ACK_data_udp
+    Return Value: int
+    Workflow: Called for socket i whose receive buffer was acknowledged to be full earlier. The caller holds mtx_recvbuf.
+              It recalculates the empty space and, if the user has freed some of the receive buffer,
+              writes the ACK advertising the new space to ACK_data_udp and returns 1.
+              Returns 0 if the buffer is still full.
 */
-mtp_socket *create_shared_MTP_Table()
+int refresh_rwnd(mtp_socket *MTP_Table, int i, char *ACK_data_udp)
 {
-    int sm_key = ftok(".", KEY_MTP_TABLE);
-    int sm_id_MTP_Table = shmget(sm_key, (SIZE_SM) * sizeof(mtp_socket), 0777 | IPC_CREAT);
-    mtp_socket *MTP_Table = (mtp_socket *)shmat(sm_id_MTP_Table, 0, 0);
-    return MTP_Table;
+    unsigned long long consumed = __atomic_load_n(&MTP_Table[i].rwnd.consumed, __ATOMIC_ACQUIRE);
+    int empty_space = RECV_BUFFSIZE - (int)(MTP_Table[i].rwnd.inserted - consumed);
+    if (empty_space != 0)
+    {
+        // Empty space in receive buffer: build the ACK
+        ACK_data_udp[0] = 'A';
+        ACK_data_udp[1] = (char)(MTP_Table[i].rwnd.last_inorder_received + 'a');
+        ACK_data_udp[2] = (char)(empty_space + 'a');
+        return 1;
+    }
+    return 0;
 }
 
 /*
-    Function: create_shared_variables
-    Arguments: None
-    Return Value: shared_variables *
-    Workflow: Creates a shared memory segment for shared variables.
-              It first generates a key using ftok function based on the current directory and KEY_SHARED_RESOURCE.
-              Then it obtains a shared memory identifier using shmget function with the generated key,
-              allocating memory for the size of shared_variables structure.
-              Finally, it attaches the shared memory segment to the process address space using shmat
-              and returns a pointer to the shared variables.
+    Function: send_segments
+    Arguments: int fd, struct sockaddr_in *dest, char *data, int len, int seg_size
+    Return Value: void
+    Workflow: Sends one datagram (seg_size 0) or the datagrams of a GSO send, queued on the ring of the calling
+              thread with the io_uring backend, or at once otherwise.
 */
-shared_variables *create_shared_variables()
+void send_segments(int fd, struct sockaddr_in *dest, char *data, int len, int seg_size)
 {
-    int sm_key = ftok(".", KEY_SHARED_RESOURCE);
-    int sm_id_shared_vars = shmget(sm_key, sizeof(int), 0777 | IPC_CREAT);
-    shared_variables *vars = (shared_variables *)shmat(sm_id_shared_vars, 0, 0);
-    return vars;
+    if (thread_uring != NULL)
+        uring_send_frame(thread_uring, fd, dest, data, len, seg_size);
+    else
+        send_direct(fd, dest, data, len, seg_size);
 }
 
 /*
-    Function: create_entry_semaphore
-    Arguments: int *id
+    Function: gso_flush
+    Arguments: void
     Return Value: void
-    Workflow: Creates a semaphore for entry synchronization.
-              It first generates a key using ftok function based on the current directory and KEY_ENTRY_SEM.
-              Then it obtains a semaphore identifier using semget function with the generated key,
-              creating a new semaphore if it does not exist, and setting the permission to 0777 | IPC_CREAT.
-              Afterward, it initializes the semaphore value to 0 using semctl.
+    Workflow: Sends the frames batched by S_Thread: a single frame as a plain datagram, several as one GSO send.
 */
-void create_entry_semaphore(int *id)
+void gso_flush()
 {
-    int sm_key = ftok(".", KEY_ENTRY_SEM);
-    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
-    semctl(*id, 0, SETVAL, 0);
+    gso_batch *b = thread_batch;
+    if (b->count > 0)
+        send_segments(b->fd, &b->dest, b->data, b->len, (b->count > 1) ? b->seg_size : 0);
+    b->count = 0;
+    b->len = 0;
 }
 
 /*
-    Function: create_exit_semaphore
-    Arguments: int *id
+    Function: gso_add
+    Arguments: int fd, struct sockaddr_in *dest, char *frame, int len
     Return Value: void
-    Workflow: Creates a semaphore for exit synchronization.
-              It first generates a key using ftok function based on the current directory and KEY_EXIT_SEM.
-              Then it obtains a semaphore identifier using semget function with the generated key,
-              creating a new semaphore if it does not exist, and setting the permission to 0777 | IPC_CREAT.
-              Afterward, it initializes the semaphore value to 0 using semctl.
+    Workflow: Adds a frame to the batch of S_Thread. The batch is sent first if the frame can not join it: another
+              UDP socket or destination, a frame longer than the segments, a batch already ended by a shorter
+              frame (only the last segment of a GSO send may be short), or a full batch.
 */
-void create_exit_semaphore(int *id)
+void gso_add(int fd, struct sockaddr_in *dest, char *frame, int len)
 {
-    int sm_key = ftok(".", KEY_EXIT_SEM);
-    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
-    semctl(*id, 0, SETVAL, 0);
+    gso_batch *b = thread_batch;
+    if (b->count > 0 &&
+        (b->fd != fd || b->dest.sin_port != dest->sin_port || b->dest.sin_addr.s_addr != dest->sin_addr.s_addr ||
+         len > b->seg_size || b->len != b->count * b->seg_size || b->len + len > GSO_MAX_BYTES))
+        gso_flush();
+
+    if (b->count == 0)
+    {
+        b->fd = fd;
+        b->dest = *dest;
+        b->seg_size = len;
+    }
+    memcpy(b->data + b->len, frame, len);
+    b->len += len;
+    b->count++;
 }
 
 /*
-    Function: create_mtx_table_info
-    Arguments: int *id
+    Function: send_frame
+    Arguments: mtp_socket *MTP_Table, int i, char *frame, int len
     Return Value: void
-    Workflow: Creates a mutex semaphore for controlling access to the MTP table information.
-              It first generates a key using ftok function based on the current directory and KEY_MUTEX.
-              Then it obtains a semaphore identifier using semget function with the generated key,
-              creating a new semaphore if it does not exist, and setting the permission to 0777 | IPC_CREAT.
-              Afterward, it initializes the semaphore value to 1 to indicate the mutex is available using semctl.
+    Workflow: Sends a frame ('D' or 'A' followed by its fields) of socket i to its destination over UDP.
+              With STREAM_MUX the stream id of the socket is inserted after the frame type. With the io_uring backend
+              the frame is queued on the ring of the calling thread and sent with its next submission. In S_Thread,
+              with UDP_OFFLOAD, the frame joins the GSO batch sent by gso_flush.
 */
-void create_mtx_table_info(int *id)
+void send_frame(mtp_socket *MTP_Table, int i, char *frame, int len)
 {
-    int sm_key = ftok(".", KEY_MUTEX);
-    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
-    semctl(*id, 0, SETVAL, 1);
+    char wire[FRAME_MAX];
+    if (STREAM_MUX)
+    {
+        wire[0] = frame[0];
+        wire[1] = (char)MTP_Table[i].stream_id;
+        memcpy(wire + 2, frame + 1, len - 1);
+        frame = wire;
+        len++;
+    }
+    struct sockaddr_in dest_addr = sock_converter(MTP_Table[i].dest_ip, MTP_Table[i].dest_port);
+    if (thread_batch != NULL && !gso_off)
+        gso_add(MTP_Table[i].udp_sockid, &dest_addr, frame, len);
+    else
+        send_segments(MTP_Table[i].udp_sockid, &dest_addr, frame, len, 0);
 }
 
 /*
-    Function: create_mutex_swnd
-    Arguments: int *id
+    Function: demux_frame
+    Arguments: mtp_socket *MTP_Table, int udp_id, struct sockaddr_in *from, char *udp_data, int *bytes, int *stream
+    Return Value: int
+    Workflow: With STREAM_MUX, finds the MTP socket a datagram read from UDP socket udp_id belongs to: the one using
+              that UDP socket whose destination is the sender and whose stream id is the one in the frame.
+              The stream id is removed from the frame and stored in *stream. Returns the MTP socket, or -1 if there is none.
+*/
+int demux_frame(mtp_socket *MTP_Table, int udp_id, struct sockaddr_in *from, char *udp_data, int *bytes, int *stream)
+{
+    if (*bytes < 2)
+        return -1;
+
+    *stream = (unsigned char)udp_data[1];
+    memmove(udp_data + 1, udp_data + 2, *bytes - 2);
+    (*bytes)--;
+
+    for_each_socket(j, &MTP_SHARED(MTP_Table)->active)
+    {
+        if (MTP_Table[j].free || MTP_Table[j].udp_sockid != udp_id || MTP_Table[j].stream_id != *stream)
+            continue;
+        struct sockaddr_in dest_addr = sock_converter(MTP_Table[j].dest_ip, MTP_Table[j].dest_port);
+        if (dest_addr.sin_port == from->sin_port && dest_addr.sin_addr.s_addr == from->sin_addr.s_addr)
+            return j;
+    }
+    return -1;
+}
+
+/*
+    Function: accept_peer
+    Arguments: mtp_socket *MTP_Table, int udp_id, struct sockaddr_in *from, int stream, char *udp_data
+    Return Value: int
+    Workflow: Handles a frame read from UDP socket udp_id that no MTP socket is connected to the sender of.
+              If a server socket (m_listen) uses that UDP socket (with the frame's stream id under STREAM_MUX) and the
+              frame carries data, the sender becomes a new peer of the server: it gets a free MTP socket of the
+              server's process, sharing the UDP socket and impairment settings, with fresh windows and the sender
+              as destination, and an entry in the peer hash table. Returns that MTP socket, or -1 if the frame is dropped.
+*/
+int accept_peer(mtp_socket *MTP_Table, int udp_id, struct sockaddr_in *from, int stream, char *udp_data)
+{
+    if (udp_data[0] != 'D' && udp_data[0] != 'C')
+        return -1;
+
+    down(mtx_table_info);
+    int server = -1;
+    for_each_socket(j, &MTP_SHARED(MTP_Table)->active)
+    {
+        if (!MTP_Table[j].free && MTP_Table[j].server == j && MTP_Table[j].udp_sockid == udp_id &&
+            (!STREAM_MUX || MTP_Table[j].stream_id == stream))
+        {
+            server = j;
+            break;
+        }
+    }
+
+    // The peer may have been added since R_Thread looked it up without the lock
+    int peer = (server < 0) ? -1 : peer_hash_find(MTP_SHARED(MTP_Table)->peers, server, from->sin_addr.s_addr, from->sin_port);
+    if (server < 0 || peer >= 0)
+    {
+        up(mtx_table_info);
+        return peer;
+    }
+
+    for_each_free_socket(j, &MTP_SHARED(MTP_Table)->active)
+    {
+        if (MTP_Table[j].free != 1)
+            continue;
+
+        reset_windows(MTP_Table, j);
+        MTP_Table[j].pid = MTP_Table[server].pid;
+        MTP_Table[j].udp_sockid = udp_id;
+        MTP_Table[j].src_addr = MTP_Table[server].src_addr;
+        inet_ntop(AF_INET, &from->sin_addr, MTP_Table[j].dest_ip, IP_SIZE);
+        MTP_Table[j].dest_port = ntohs(from->sin_port);
+        MTP_Table[j].stream_id = MTP_Table[server].stream_id;
+        MTP_Table[j].compress = MTP_Table[server].compress;
+        MTP_Table[j].weight = MTP_Table[server].weight;
+        MTP_Table[j].server = server;
+        MTP_Table[j].poller = MTP_Table[server].poller;
+        memset(&MTP_Table[j].stats, 0, sizeof(mtp_stats));
+        MTP_Table[j].impair = MTP_Table[server].impair;
+        impair_reset(MTP_Table, j);
+        watch_owner(MTP_Table, j);
+        MTP_Table[j].free = 0;
+
+        peer_hash_insert(MTP_SHARED(MTP_Table)->peers, server, from->sin_addr.s_addr, from->sin_port, j);
+        socket_set_add(&MTP_SHARED(MTP_Table)->active, j);
+        up(mtx_table_info);
+
+        LOG(LOG_INFO, "Server socket %d: new peer %s:%d on socket %d\n", server, MTP_Table[j].dest_ip, MTP_Table[j].dest_port, j);
+        return j;
+    }
+    up(mtx_table_info);
+
+    LOG(LOG_WARN, "Server socket %d: no free MTP socket for a new peer\n", server);
+    return -1;
+}
+
+/*
+    Function: process_frame
+    Arguments: mtp_socket *MTP_Table, int i, char *udp_data, int bytes
     Return Value: void
-    Workflow: Creates a mutex semaphore for controlling access to the send window.
-              It first generates a key using ftok function based on the current directory and KEY_MUTEX_SWND.
-              Then it obtains a semaphore identifier using semget function with the generated key,
-              creating a new semaphore if it does not exist, and setting the permission to 0777 | IPC_CREAT.
-              Afterward, it initializes the semaphore value to 1 to indicate the mutex is available using semctl.
+    Workflow: Handles a frame of the given size received over UDP for socket i (after the impairment emulator let it through).
+              An ACK updates the send window, a data frame goes into the receive buffer and is acknowledged.
+              With FRAME_CRC a data frame whose CRC32C does not match is dropped (counted in drops and crc_errors)
+              before it reaches the receive buffer; it is not acknowledged, so the sender retransmits it.
+              A compressed data frame ('C') is decompressed back into a 'D' frame first, and dropped if that fails.
 */
-void create_mutex_swnd(int *id)
+void process_frame(mtp_socket *MTP_Table, int i, char *udp_data, int bytes)
 {
-    int sm_key = ftok(".", KEY_MUTEX_SWND);
-    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
-    semctl(*id, 0, SETVAL, 1);
+    // Message is acknowledgement
+    if (udp_data[0] == 'A')
+    {
+        down(mtx_swnd);
+        down(mtx_sendbuf);
+        update_swnd_on_ack(MTP_Table, i, (int)(udp_data[1] - 'a'), (int)(udp_data[2] - 'a'));
+        up(mtx_sendbuf);
+        up(mtx_swnd);
+    }
+    // Message is user data
+    else
+    {
+        if (FRAME_CRC && !frame_crc_ok(udp_data, bytes))
+        {
+            STAT_ADD(MTP_Table[i], drops, 1);
+            STAT_ADD(MTP_Table[i], crc_errors, 1);
+            return;
+        }
+
+        char plain[KB + 2];
+        if (udp_data[0] == 'C')
+        {
+            plain[0] = 'D';
+            plain[1] = udp_data[1];
+            if (lz_decompress(udp_data + 2, bytes - 2 - (FRAME_CRC ? 4 : 0), plain + 2, KB) != KB)
+            {
+                STAT_ADD(MTP_Table[i], drops, 1);
+                return;
+            }
+            udp_data = plain;
+        }
+
+        down(mtx_recvbuf);
+
+        char ACK_data_udp[3];
+        receive_data(MTP_Table, i, udp_data, ACK_data_udp);
+
+        // Send the ACK
+        send_frame(MTP_Table, i, ACK_data_udp, 3);
+
+        up(mtx_recvbuf);
+    }
 }
 
 /*
-    Function: create_mutex_recvbuf
-    Arguments: int *id
+    Function: release_delayed_frames
+    Arguments: mtp_socket *MTP_Table
     Return Value: void
-    Workflow: Creates a mutex semaphore for controlling access to the receive buffer.
-              It first generates a key using ftok function based on the current directory and KEY_MUTEX_RECVBUF.
-              Then it obtains a semaphore identifier using semget function with the generated key,
-              creating a new semaphore if it does not exist, and setting the permission to 0777 | IPC_CREAT.
-              Afterward, it initializes the semaphore value to 1 to indicate the mutex is available using semctl.
+    Workflow: Processes every frame of the delay heap whose due time has passed, in due time order.
+              Frames of a socket that was closed (or reused) while they were held back are discarded.
 */
-void create_mutex_recvbuf(int *id)
+void release_delayed_frames(mtp_socket *MTP_Table)
 {
-    int sm_key = ftok(".", KEY_MUTEX_RECVBUF);
-    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
-    semctl(*id, 0, SETVAL, 1);
+    unsigned long long now = monotonic_ns();
+    while (delayed_count > 0 && delayed_frames[0].due_ns <= now)
+    {
+        delayed_frame f;
+        delayed_pop(&f);
+
+        if (MTP_Table[f.mtp_id].free || MTP_Table[f.mtp_id].udp_sockid != f.udp_sockid)
+            continue;
+
+        f.data[f.bytes] = '\0';
+        process_frame(MTP_Table, f.mtp_id, f.data, f.bytes);
+    }
 }
 
 /*
-    Function: create_mutex_sendbuf
-    Arguments: int *id
+    Function: receive_datagram
+    Arguments: mtp_socket *MTP_Table, int i, int udp_id, struct sockaddr_in *from, char *udp_data, int bytes
     Return Value: void
-    Workflow: Creates a mutex semaphore for controlling access to the send buffer.
-              It first generates a key using ftok function based on the current directory and KEY_MUTEX_SENDBUF.
-              Then it obtains a semaphore identifier using semget function with the generated key,
-              creating a new semaphore if it does not exist, and setting the permission to 0777 | IPC_CREAT.
-              Afterward, it initializes the semaphore value to 1 to indicate the mutex is available using semctl.
+    Workflow: Handles a datagram of the given size read from UDP socket udp_id, which MTP socket i uses. Finds the MTP
+              socket of the sender (by stream id with STREAM_MUX, in the peer hash table for a server socket, or as a
+              new peer of the server), lets the impairment emulator drop, delay, duplicate or reorder it as configured
+              with m_setimpair, and processes it. udp_data has room for one more byte, for the terminating '\0'.
 */
-void create_mutex_sendbuf(int *id)
+void receive_datagram(mtp_socket *MTP_Table, int i, int udp_id, struct sockaddr_in *from, char *udp_data, int bytes)
 {
-    int sm_key = ftok(".", KEY_MUTEX_SENDBUF);
-    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
-    semctl(*id, 0, SETVAL, 1);
+    // Find the MTP socket of the sender: by stream id with STREAM_MUX, in the peer hash table for a server
+    int target = i;
+    int stream = 0;
+    if (STREAM_MUX)
+        target = demux_frame(MTP_Table, udp_id, from, udp_data, &bytes, &stream);
+    else if (MTP_Table[i].server >= 0)
+    {
+        // looked up without mtx_table_info, so checked, and looked up again under it by accept_peer
+        target = peer_hash_find(MTP_SHARED(MTP_Table)->peers, MTP_Table[i].server, from->sin_addr.s_addr, from->sin_port);
+        if (target >= 0 && (MTP_Table[target].free || MTP_Table[target].server != MTP_Table[i].server))
+            target = -1;
+    }
+
+    if (target < 0 && (target = accept_peer(MTP_Table, udp_id, from, stream, udp_data)) < 0)
+        return;
+
+    // Drop, delay, duplicate or reorder the message as configured with m_setimpair
+    if (!impair_receive(MTP_Table, target, udp_data, bytes))
+        return;
+
+    udp_data[bytes] = '\0';
+    process_frame(MTP_Table, target, udp_data, bytes);
+}
+
+/*
+    Function: receive_segments
+    Arguments: mtp_socket *MTP_Table, int i, int udp_id, struct sockaddr_in *from, char *data, int bytes, int seg_size,
+               unsigned long long arrival_ns
+    Return Value: void
+    Workflow: Handles what one read from UDP socket udp_id returned: a single datagram if seg_size is 0, or a GRO
+              batch of datagrams of seg_size bytes (the last one possibly shorter) from the same sender, received by
+              the kernel at arrival_ns (0 if unknown). Each datagram goes to receive_datagram in a buffer of its own;
+              one longer than a frame is cut, as recvfrom did.
+*/
+void receive_segments(mtp_socket *MTP_Table, int i, int udp_id, struct sockaddr_in *from, char *data, int bytes, int seg_size,
+                      unsigned long long arrival_ns)
+{
+    frame_arrival_ns = arrival_ns;
+    if (seg_size <= 0)
+        seg_size = bytes;
+    for (int off = 0; off < bytes; off += seg_size)
+    {
+        char udp_data[FRAME_MAX];
+        int len = (bytes - off < seg_size) ? bytes - off : seg_size;
+        if (len > FRAME_MAX - 1)
+            len = FRAME_MAX - 1;
+        memcpy(udp_data, data + off, len);
+        receive_datagram(MTP_Table, i, udp_id, from, udp_data, len);
+    }
+    frame_arrival_ns = 0;
 }
 
 /*
-    Function: dropMessage
-    Arguments: float p
+    Function: read_datagrams
+    Arguments: mtp_socket *MTP_Table, int i, int udp_id, int flags
     Return Value: int
-    Workflow: Simulates dropping a message with a given probability. It generates a random number between 0 and 1,
-              compares it with the given probability p. If the random number is less than p, it returns 1 indicating
-              success (message dropped). Otherwise, it returns 0 indicating failure (message not dropped).
+    Workflow: Reads a datagram, or a GRO batch of datagrams with UDP_OFFLOAD, from UDP socket udp_id (used by MTP
+              socket i) with the recvmsg flags given, and hands it to receive_segments with its kernel timestamp.
+              Returns what recvmsg did.
 */
-int dropMessage(float p)
+int read_datagrams(mtp_socket *MTP_Table, int i, int udp_id, int flags)
 {
-    float random_number = (float)(rand() % 1000) / 1000;
+    static __thread char data[UDP_OFFLOAD ? GRO_BUF_SIZE : FRAME_MAX];
+    char control[RECV_CONTROL];
+    struct sockaddr_in from;
+    struct iovec iov = {.iov_base = data, .iov_len = sizeof(data)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int bytes = recvmsg(udp_id, &msg, flags);
+    if (bytes > 0)
+        receive_segments(MTP_Table, i, udp_id, &from, data, bytes, gro_segment_size(&msg), kernel_arrival_ns(&msg));
+    return bytes;
+}
 
-    if (random_number < p)
+/*
+    Function: refresh_full_rwnd
+    Arguments: mtp_socket *MTP_Table, int i
+    Return Value: void
+    Workflow: Called by R_Thread for socket i when no frame arrived for it in this round. If its receive buffer was
+              acknowledged to be full earlier and the user has taken messages since, the ACK advertising the new space
+              is sent (S_Thread does this for a local peer).
+*/
+void refresh_full_rwnd(mtp_socket *MTP_Table, int i)
+{
+    if (MTP_Table[i].rwnd.nospace == 1 && find_local_peer(MTP_Table, i) < 0)
     {
-        return 1;
+        down(mtx_recvbuf);
+
+        char ACK_data_udp[3];
+        if (refresh_rwnd(MTP_Table, i, ACK_data_udp))
+        {
+            // Send the ACK
+            send_frame(MTP_Table, i, ACK_data_udp, 3);
+        }
+        up(mtx_recvbuf);
     }
-    else
+}
+
+/*
+    Function: r_wait_ns
+    Arguments: None
+    Return Value: unsigned long long
+    Workflow: How long R_Thread may wait for datagrams: the select timeout, or less if a frame held back by the
+              impairment emulator is due earlier.
+*/
+unsigned long long r_wait_ns()
+{
+    unsigned long long wait_ns = (unsigned long long)TIMEOUT_S * 1000000000ULL + TIMEOUT_US * 1000ULL;
+    if (delayed_count > 0)
     {
-        return 0;
+        unsigned long long now = monotonic_ns();
+        unsigned long long due_ns = (delayed_frames[0].due_ns > now) ? delayed_frames[0].due_ns - now : 0;
+        if (due_ns < wait_ns)
+            wait_ns = due_ns;
     }
+    return wait_ns;
 }
 
 /*
-    Function: socket_handler
-    Arguments: mtp_socket *MTP_Table, shared_variables *shared_resource, int *entry_sem, int *exit_sem
-    Return Value: void
-    Workflow: Handles socket operations such as creation, binding, and closing in response to requests from user processes.
-              It continuously waits for requests by blocking on the entry semaphore.
-              Upon receiving a request, it performs the appropriate socket operation based on the shared_resource status.
-              It updates the return value and error number in the shared resource accordingly.
-              After processing, it signals the user process by releasing the exit semaphore.
+    Function: uring_receive
+    Arguments: mtp_socket *MTP_Table, mtp_uring *u, struct io_uring_cqe *cqe
+    Return Value: int
+    Workflow: Handles the completion of a multishot receive: the datagram, or GRO batch, in the provided buffer is
+              given to receive_segments for an MTP socket using the UDP socket, and the buffer is given back to the kernel.
+              After the last completion of the receive (no IORING_CQE_F_MORE: out of buffers, or the socket was shut
+              down) it is armed again by the next round if the socket is still in use. Returns the UDP socket if a datagram was handled, -1 otherwise.
 */
-void socket_handler(mtp_socket *MTP_Table, shared_variables *shared_resource, int *entry_sem, int *exit_sem)
+int uring_receive(mtp_socket *MTP_Table, mtp_uring *u, struct io_uring_cqe *cqe)
 {
-    int socket_id;
-    /* The main thread(after creating R and S) for the rest of its lifetime
-    server the user processes for creating, binding and closing the sockets */
+    int udp_id = (int)cqe->user_data;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uring_disarm(u, udp_id);
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        return -1;
+
+    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buf = u->bufs + (size_t)bid * URING_BUF_SIZE;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    struct sockaddr_in *from = (struct sockaddr_in *)(out + 1);
+    struct msghdr control = {.msg_control = (char *)(out + 1) + u->recv_msg.msg_namelen, .msg_controllen = out->controllen};
+    char *data = (char *)(out + 1) + u->recv_msg.msg_namelen + u->recv_msg.msg_controllen;
+    int bytes = (out->payloadlen < URING_PAYLOAD) ? (int)out->payloadlen : URING_PAYLOAD;
+
+    int handled = -1;
+    if (cqe->res > 0 && bytes > 0)
+    {
+        for_each_socket(i, &MTP_SHARED(MTP_Table)->active)
+        {
+            if (!MTP_Table[i].free && MTP_Table[i].udp_sockid == udp_id)
+            {
+                receive_segments(MTP_Table, i, udp_id, from, data, bytes, gro_segment_size(&control), kernel_arrival_ns(&control));
+                handled = udp_id;
+                break;
+            }
+        }
+    }
+    uring_recycle(u, bid);
+    return handled;
+}
+
+/*
+    Function: uring_receive_loop
+    Arguments: mtp_socket *MTP_Table, mtp_uring *u
+    Return Value: void (does not return)
+    Workflow: R_Thread with the io_uring backend. Each round arms a multishot receive on the UDP sockets in use that
+              have none (submitted at once, under uring_arm_lock, so that close_udp_socket can cancel it), submits the
+              ACKs queued by the previous round and waits, in one io_uring_enter, for a completion or the time
+              r_wait_ns allows. Then every completion is handled: datagrams go to
+              receive_segments, sends free their slot. The sockets that got nothing have their full receive buffer
+              refreshed, and the frames due from the impairment emulator are released, as in the select loop.
+*/
+void uring_receive_loop(mtp_socket *MTP_Table, mtp_uring *u)
+{
+    LOG(LOG_INFO, "R Thread ready to go...\n");
 
-    printf("Main Thread ready to go...\n");
     while (1)
     {
-        down(*entry_sem);
-        shared_resource->error_no = 0;
-        /* Respond to socket creation call */
-        if (shared_resource->status == 0)
+        pthread_mutex_lock(&uring_arm_lock);
+        int armed = u->armed_count;
+        for_each_socket(i, &MTP_SHARED(MTP_Table)->active)
         {
-            socket_id = socket(AF_INET, SOCK_DGRAM, 0);
-            MTP_Table[shared_resource->mtp_id].udp_sockid = socket_id;
-            shared_resource->return_value = socket_id;
-            shared_resource->error_no = errno;
+            if (!MTP_Table[i].free)
+                uring_arm_receive(u, MTP_Table[i].udp_sockid);
         }
-        /* Respond to bind call */
-        else if (shared_resource->status == 1)
+        if (u->armed_count != armed)
+            uring_submit(u, 0, 0);
+        pthread_mutex_unlock(&uring_arm_lock);
+
+        uring_submit(u, 1, r_wait_ns());
+
+        // UDP sockets that delivered datagrams in this round
+        int got[SIZE_SM];
+        int got_count = 0;
+
+        unsigned int head = *u->cq_head;
+        unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
         {
-            socket_id = MTP_Table[shared_resource->mtp_id].udp_sockid;
-            shared_resource->return_value = bind(socket_id, (const struct sockaddr *)&(shared_resource->src_addr), sizeof(shared_resource->src_addr));
-            shared_resource->error_no = errno;
+            struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+            if (cqe->user_data & URING_SEND_TAG)
+            {
+                uring_send_done(u, cqe);
+                continue;
+            }
+            int udp_id = uring_receive(MTP_Table, u, cqe);
+            int k = 0;
+            while (k < got_count && got[k] != udp_id)
+                k++;
+            if (udp_id >= 0 && k == got_count && got_count < SIZE_SM)
+                got[got_count++] = udp_id;
         }
-        /* Respond to close call */
-        else if (shared_resource->status == 2)
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+        for_each_socket(i, &MTP_SHARED(MTP_Table)->active)
         {
-            socket_id = MTP_Table[shared_resource->mtp_id].udp_sockid;
-            shared_resource->return_value = close(socket_id);
-            shared_resource->error_no = errno;
+            if (MTP_Table[i].free)
+                continue;
+            int k = 0;
+            while (k < got_count && got[k] != MTP_Table[i].udp_sockid)
+                k++;
+            /* Receive buffer was acknowledged to be full earlier (S_Thread does this for a local peer) */
+            if (k == got_count)
+                refresh_full_rwnd(MTP_Table, i);
         }
-        shared_resource->status = -1;
-        up(*exit_sem);
+
+        release_delayed_frames(MTP_Table);
     }
 }
 
-/*--------------------------------------------------------------------------------------------------------------------*/
-
-/*----------------------------------------------------R THREAD----------------------------------------------------------*/
-
 /*
     Function: R_Thread
     Arguments:
@@ -358,56 +2982,35 @@ void socket_handler(mtp_socket *MTP_Table, shared_variables *shared_resource, in
     Workflow:
         - Extract the total shared resources from the argument.
         - Initialize local pointers to the MTP socket table and shared variables.
-        - Acquire mutex lock for the receive buffer.
-        - Initialize the receive buffer and receive window variables for each socket ID.
-        - Release the mutex lock.
+        - With MTP_IO=uring, hand over to uring_receive_loop (see IO_URING), which replaces the select loop.
         - Prepare for using the select system call.
         - Enter an infinite loop for continuous operation.
         - Set up file descriptors for select with a timeout.
-        - Monitor sockets for incoming data or timeout.
-        - Process incoming messages or timeout accordingly.
-        - If a message is received, handle acknowledgment or user data accordingly.
-        - Update receive window and send acknowledgment.
-        - If the receive buffer was earlier acknowledged to be full, update the receive window and resend acknowledgment.
-*/
-void *R_Thread(void *arg)
-{
-    argtype *total_shared_resource = (argtype *)arg;
-    mtp_socket *MTP_Table = total_shared_resource->MTP_Table;
-    shared_variables *shared_resource = total_shared_resource->shared_resource;
-
-    // initialize all varibles of receive window and receive buffer
-    down(mtx_recvbuf);
-    for (int i = 0; i < SIZE_SM; i++)
-    {
-        for (int k = 0; k < RECV_BUFFSIZE; k++)
-        {
-            MTP_Table[i].recv_buff[k].sequence_no = -1;
-        }
-        for (int k = 0; k < RWND_SIZE; k++)
-        {
-            MTP_Table[i].rwnd.window[k] = k + 1;
-        }
-        MTP_Table[i].rwnd.nospace = 0;
-        MTP_Table[i].rwnd.last_inorder_received = 0;
-        MTP_Table[i].rwnd.last_user_taken = 0;
-    }
-    up(mtx_recvbuf);
+        - Monitor sockets for incoming data or timeout.
+        - Process incoming messages or timeout accordingly (receive_datagram).
+        - If a message is received, handle acknowledgment or user data accordingly.
+        - Update receive window and send acknowledgment.
+        - If the receive buffer was earlier acknowledged to be full, update the receive window and resend acknowledgment.
+*/
+void *R_Thread(void *arg)
+{
+    argtype *total_shared_resource = (argtype *)arg;
+    mtp_socket *MTP_Table = total_shared_resource->MTP_Table;
 
     fd_set read_fds;
     int max_fd_value = 0;
     int action = 0;
     struct timeval tout;
 
-    printf("R Thread ready to go...\n");
+    place_thread("R");
+    if (uring_wanted() && (thread_uring = uring_open("R", 1)) != NULL)
+        uring_receive_loop(MTP_Table, thread_uring);
+    LOG(LOG_INFO, "R Thread ready to go...\n");
 
     while (1)
     {
-        tout.tv_sec = TIMEOUT_S;
-        tout.tv_usec = TIMEOUT_US;
-
         FD_ZERO(&read_fds);
-        for (int i = 0; i < SIZE_SM; i++)
+        for_each_socket(i, &MTP_SHARED(MTP_Table)->active)
         {
             if (!MTP_Table[i].free)
             {
@@ -418,6 +3021,11 @@ void *R_Thread(void *arg)
             }
         }
 
+        // wake up for the next frame held back by the impairment emulator
+        unsigned long long wait_ns = r_wait_ns();
+        tout.tv_sec = wait_ns / 1000000000ULL;
+        tout.tv_usec = (wait_ns % 1000000000ULL) / 1000;
+
         // wait on select call
         action = select(max_fd_value + 1, &read_fds, NULL, NULL, &tout);
 
@@ -427,7 +3035,7 @@ void *R_Thread(void *arg)
             // continue; //// DO NOT USE IT
         }
 
-        for (int i = 0; i < SIZE_SM; i++)
+        for_each_socket(i, &MTP_SHARED(MTP_Table)->active)
         {
             if (!MTP_Table[i].free)
             {
@@ -435,230 +3043,27 @@ void *R_Thread(void *arg)
                 /* Some message received */
                 if (FD_ISSET(MTP_Table[i].udp_sockid, &read_fds))
                 {
-                    char udp_data[KB + 6];
                     int udp_id = MTP_Table[i].udp_sockid;
-                    struct sockaddr_in dest_addr = sock_converter(MTP_Table[i].dest_ip, MTP_Table[i].dest_port);
-                    int len = sizeof(dest_addr);
-                    int bytes = recvfrom(udp_id, udp_data, KB + 6, 0, (struct sockaddr *)&dest_addr, &len);
-
-                    // if error
-                    if (bytes <= 0)
-                        continue;
-
-                    // Drop the message with probability P
-                    if (dropMessage((float)P))
-                    {
-                        continue;
-                    }
-
-                    udp_data[bytes] = '\0';
 
-                    // Message is acknowledgement
-                    if (udp_data[0] == 'A')
+                    // A UDP socket shared by several streams is read once per wakeup, for all of them
+                    FD_CLR(udp_id, &read_fds);
+                    int batch = (STREAM_MUX || MTP_Table[i].server >= 0) ? MUX_RECV_BATCH : 1;
+                    for (int n = 0; n < batch; n++)
                     {
-                        down(mtx_swnd);
-                        int ack_seqno = (int)(udp_data[1] - 'a');
-                        int curr_empty_space = (int)(udp_data[2] - 'a');
-                        send_window curr_swnd = MTP_Table[i].swnd;
-                        int last_ack_seqno = curr_swnd.last_ack_seqno;
-
-                        int flag_dup_seq_ack = 0;
-                        if (max_logical(last_ack_seqno, ack_seqno, MAX_SEQ_NO) == last_ack_seqno && curr_swnd.last_ack_emptyspace == curr_empty_space)
-                        {
-                            // Duplicate ACK received
-                            up(mtx_swnd);
-                            continue;
-                        }
-                        else
-                        {
-                            if (max_logical(last_ack_seqno, ack_seqno, MAX_SEQ_NO) == last_ack_seqno && curr_swnd.last_ack_emptyspace != curr_empty_space)
-                            {
-                                flag_dup_seq_ack = 1;
-                            }
-
-                            // Update the send window upon receiving valid ACK
-                            down(mtx_sendbuf);
-
-                            int k = MTP_Table[i].swnd.left_idx;
-                            if (flag_dup_seq_ack == 0)
-                            {
-                                while (MTP_Table[i].send_buff[k].sequence_no != ack_seqno)
-                                {
-                                    MTP_Table[i].send_buff[k].sequence_no = -1;
-                                    k = (k + 1) % SEND_BUFFSIZE;
-                                }
-                                MTP_Table[i].send_buff[k].sequence_no = -1;
-                                k = (k + 1) % SEND_BUFFSIZE;
-                            }
-
-                            MTP_Table[i].swnd.left_idx = k;
-                            MTP_Table[i].swnd.right_idx = (k + curr_empty_space - 1 + SEND_BUFFSIZE) % SEND_BUFFSIZE;
-                            MTP_Table[i].swnd.last_ack_seqno = ack_seqno;
-                            MTP_Table[i].swnd.last_ack_emptyspace = curr_empty_space;
-
-                            up(mtx_sendbuf);
-                        }
-
-                        up(mtx_swnd);
-                    }
-                    // Message is user data
-                    else
-                    {
-                        down(mtx_recvbuf);
-
-                        // Insert the user data in the receive buffer at appropriate position
-                        int new_data_received = 0;
-                        int seq_no = (int)(udp_data[1] - 'a');
-                        for (int k = 0; k < RWND_SIZE; k++)
-                        {
-                            if (MTP_Table[i].rwnd.window[k] == seq_no)
-                            {
-                                for (int e = 0; e < RECV_BUFFSIZE; e++)
-                                {
-                                    if (MTP_Table[i].recv_buff[e].sequence_no == -1)
-                                    {
-                                        // put data in receive buffer
-                                        new_data_received = 1;
-                                        MTP_Table[i].recv_buff[e].sequence_no = seq_no;
-                                        my_strcpy(MTP_Table[i].recv_buff[e].data, udp_data + 2, KB);
-
-                                        break;
-                                    }
-                                }
-                                break;
-                            }
-                        }
-
-                        // Calculate the empty space and reconstruct the receive window
-                        int empty_space = 0;
-                        int seqno_at_buff[MAX_SEQ_NO + 1];
-                        memset(seqno_at_buff, 0, sizeof(seqno_at_buff));
-
-                        for (int k = 0; k < RECV_BUFFSIZE; k++)
-                        {
-                            if (MTP_Table[i].recv_buff[k].sequence_no == -1)
-                            {
-                                empty_space++;
-                            }
-                            else
-                            {
-                                seqno_at_buff[MTP_Table[i].recv_buff[k].sequence_no] = 1;
-                            }
-                        }
-
-                        int curr = (MTP_Table[i].rwnd.last_inorder_received) % MAX_SEQ_NO + 1;
-                        while (1)
-                        {
-                            if (seqno_at_buff[curr] == 1)
-                            {
-                                MTP_Table[i].rwnd.last_inorder_received = curr;
-                            }
-                            else
-                            {
-                                break;
-                            }
-                            curr = (curr) % MAX_SEQ_NO + 1;
-                        }
-
-                        if (empty_space != 0)
-                        {
-                            // Update receive window
-                            memset(MTP_Table[i].rwnd.window, -1, sizeof(MTP_Table[i].rwnd.window));
-                            int rwnd_idx = 0;
-                            int curr = (MTP_Table[i].rwnd.last_inorder_received) % MAX_SEQ_NO + 1;
-
-                            for (int e = 1; e <= empty_space; e++)
-                            {
-                                while (seqno_at_buff[curr] != 0)
-                                {
-                                    curr = (curr) % MAX_SEQ_NO + 1;
-                                }
-                                MTP_Table[i].rwnd.window[rwnd_idx++] = curr;
-                                curr = (curr) % MAX_SEQ_NO + 1;
-                            }
-                            for (; rwnd_idx < RWND_SIZE;)
-                            {
-                                MTP_Table[i].rwnd.window[rwnd_idx++] = -1;
-                            }
-                            //*******************************
-                            // First message received after sending special ACK for having space after nospace flag has been set
-                            if (MTP_Table[i].rwnd.nospace == 1 && new_data_received)
-                            {
-                                MTP_Table[i].rwnd.nospace = 0;
-                            }
-                            //*******************************
-                        }
-
-                        // Send the ACK
-                        char ACK_data_udp[3] = {'A', (char)(MTP_Table[i].rwnd.last_inorder_received + 'a'), (char)(empty_space + 'a')};
-                        int udp_id = MTP_Table[i].udp_sockid;
-                        struct sockaddr_in dest_addr = sock_converter(MTP_Table[i].dest_ip, MTP_Table[i].dest_port);
-                        int bytes = sendto(udp_id, ACK_data_udp, 3, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-
-                        if (empty_space == 0)
-                        {
-                            MTP_Table[i].rwnd.nospace = 1;
-                        }
-                        up(mtx_recvbuf);
+                        // if error, or nothing more to read
+                        if (read_datagrams(MTP_Table, i, udp_id, (n == 0) ? 0 : MSG_DONTWAIT) <= 0)
+                            break;
                     }
                 }
                 else
                 {
-                    /* Receive buffer was acknowledged to be full earlier */
-                    if (MTP_Table[i].rwnd.nospace == 1)
-                    {
-                        down(mtx_recvbuf);
-
-                        // Calculate the empty space and reconstruct the receive window
-                        int empty_space = 0;
-                        int seqno_at_buff[MAX_SEQ_NO + 1];
-                        memset(seqno_at_buff, 0, sizeof(seqno_at_buff));
-
-                        for (int k = 0; k < RECV_BUFFSIZE; k++)
-                        {
-                            if (MTP_Table[i].recv_buff[k].sequence_no == -1)
-                            {
-                                empty_space++;
-                            }
-                            else
-                            {
-                                seqno_at_buff[MTP_Table[i].recv_buff[k].sequence_no] = 1;
-                            }
-                        }
-                        //////////////////////////////////////////////////////////////////////////////////////////////////////////
-                        if (empty_space != 0)
-                        {
-                            // Empty space in receive buffer
-
-                            // Update receive window
-                            memset(MTP_Table[i].rwnd.window, -1, sizeof(MTP_Table[i].rwnd.window));
-                            int rwnd_idx = 0;
-                            int curr = (MTP_Table[i].rwnd.last_inorder_received) % MAX_SEQ_NO + 1;
-                            for (int e = 1; e <= empty_space; e++)
-                            {
-                                while (seqno_at_buff[curr] != 0)
-                                {
-                                    curr = (curr) % MAX_SEQ_NO + 1;
-                                }
-                                MTP_Table[i].rwnd.window[rwnd_idx++] = curr;
-                                curr = (curr) % MAX_SEQ_NO + 1;
-                            }
-                            for (; rwnd_idx < RWND_SIZE;)
-                            {
-                                MTP_Table[i].rwnd.window[rwnd_idx++] = -1;
-                            }
-
-                            // Send the ACK
-                            char ACK_data_udp[3] = {'A', (char)(MTP_Table[i].rwnd.last_inorder_received + 'a'), (char)(empty_space + 'a')};
-                            int udp_id = MTP_Table[i].udp_sockid;
-                            struct sockaddr_in dest_addr = sock_converter(MTP_Table[i].dest_ip, MTP_Table[i].dest_port);
-                            int bytes = sendto(udp_id, ACK_data_udp, 3, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-                        }
-                        up(mtx_recvbuf);
-                    }
+                    /* Receive buffer was acknowledged to be full earlier (S_Thread does this for a local peer) */
+                    refresh_full_rwnd(MTP_Table, i);
                 }
             }
         }
+
+        release_delayed_frames(MTP_Table);
     }
     pthread_exit(NULL);
 }
@@ -668,164 +3073,307 @@ void *R_Thread(void *arg)
 /*----------------------------------------------------S THREAD----------------------------------------------------------*/
 
 /*
-    Function: S_Thread
-    Arguments:
-        void *arg: A void pointer to the argument passed to the thread function.
-    Return Value: None (void *)
-
-    Workflow:
-        - Extract the total shared resources from the argument.
-        - Initialize local pointers to the MTP socket table and shared variables.
-        - Acquire mutex locks for the send window and send buffer.
-        - Initialize the send window and send buffer variables for each socket ID.
-        - Release the mutex locks.
-        - Enter an infinite loop for continuous operation.
-        - Iterate over each socket ID in the MTP socket table.
-        - If the socket is not free, acquire mutex locks for the send window and send buffer.
-        - Check the valid portion of the send window for each socket ID.
-        - Determine if there is a timeout condition for unacknowledged messages.
-        - Resend unacknowledged messages if a timeout occurred.
-        - Otherwise, send the next available messages.
-        - Release the mutex locks.
-        - Sleep for half the timeout period before the next iteration.
+    Function: transmit_message
+    Arguments: mtp_socket *MTP_Table, int i, int k, int peer, char *local_ack, int retransmit
+    Return Value: void
+    Workflow: Sends message k of the send buffer of socket i as a 'D' frame. The caller holds mtx_swnd and mtx_sendbuf.
+              If peer is a local MTP socket the frame is put straight into its receive buffer (subject to the loss
+              model of the peer, and the ACK to the loss model of socket i) and the resulting ACK is kept in local_ack,
+              to be applied by the caller once it has finished walking the window. Otherwise the frame is sent over UDP,
+              compressed as a 'C' frame if the socket has compression on (m_setcompress) and the payload compresses,
+              and with its CRC32C if FRAME_CRC is set (a local frame does not leave memory and is neither compressed
+              nor checksummed).
+              The send time of the message (CLOCK_MONOTONIC, ns) is recorded for the timeout check, and for the RTT
+              estimate unless retransmit is set (a retransmitted message gives no RTT sample).
 */
-void *S_Thread(void *arg)
+void transmit_message(mtp_socket *MTP_Table, int i, int k, int peer, char *local_ack, int retransmit)
 {
-    argtype *total_shared_resource = (argtype *)arg;
-    mtp_socket *MTP_Table = total_shared_resource->MTP_Table;
-    shared_variables *shared_resource = total_shared_resource->shared_resource;
-
-    down(mtx_swnd);
-    down(mtx_sendbuf);
-
-    // initialize all varibles of send window and send buffer
-    for (int i = 0; i < SIZE_SM; i++)
+    mtp_buffers *MTP_Buff = MTP_BUFFERS(MTP_Table);
+    // taken before the frame leaves, so that no ACK can arrive before it
+    unsigned long long now = monotonic_ns();
+    char udp_data[KB + 6];
+    udp_data[0] = 'D';
+    udp_data[1] = (char)(MTP_Buff[i].send_buff[k].sequence_no + 'a');
+    my_strcpy(udp_data + 2, MTP_Buff[i].send_buff[k].data, KB);
+
+    if (peer >= 0)
     {
-        for (int k = 0; k < SEND_BUFFSIZE; k++)
+        if (!impair_drop(MTP_Table, peer))
         {
-            MTP_Table[i].send_buff[k].sequence_no = -1;
+            char ACK_data[3];
+            down(mtx_recvbuf);
+            receive_data(MTP_Table, peer, udp_data, ACK_data);
+            up(mtx_recvbuf);
+
+            if (!impair_drop(MTP_Table, i))
+            {
+                my_strcpy(local_ack, ACK_data, 3);
+            }
         }
-        MTP_Table[i].swnd.left_idx = 0;
-        MTP_Table[i].swnd.right_idx = (RECV_BUFFSIZE - 1) % SEND_BUFFSIZE;
-        MTP_Table[i].swnd.new_entry = 0;
-        MTP_Table[i].swnd.last_seq_no = 0;
-        MTP_Table[i].swnd.last_sent = -1;
-        MTP_Table[i].swnd.last_ack_seqno = 0;
-        for (int k = 0; k < SWND_SIZE; k++)
+    }
+    else
+    {
+        int len = KB + 2;
+        if (MTP_Table[i].compress)
         {
-            MTP_Table[i].swnd.last_active_time[k] = 0;
+            // send it compressed only if that saves at least LZ_MIN_GAIN bytes
+            char packed[KB];
+            int packed_len = lz_compress(MTP_Buff[i].send_buff[k].data, KB, packed, KB - LZ_MIN_GAIN);
+            if (packed_len > 0)
+            {
+                udp_data[0] = 'C';
+                memcpy(udp_data + 2, packed, packed_len);
+                len = packed_len + 2;
+                STAT_ADD(MTP_Table[i], compressed, 1);
+            }
         }
+        if (FRAME_CRC)
+            len = frame_crc_put(udp_data, len);
+        send_frame(MTP_Table, i, udp_data, len);
+        STAT_ADD(MTP_Table[i], wire_bytes, len);
     }
-    up(mtx_sendbuf);
-    up(mtx_swnd);
 
-    printf("S Thread ready to go...\n");
+    total_message_sent++;
+    LOG(LOG_INFO, "Total message sent : %d\n", total_message_sent);
 
-    while (1)
+    if (retransmit)
     {
-        for (int i = 0; i < SIZE_SM; i++)
-        {
-            if (!MTP_Table[i].free)
-            {
-                down(mtx_swnd);
-                down(mtx_sendbuf);
-                // Checking valid portion to send
-                send_window curr_swnd = MTP_Table[i].swnd;
+        STAT_ADD(MTP_Table[i], retransmissions, 1);
+        MTP_Table[i].swnd.first_sent_ns[k] = 0;
+    }
+    else
+    {
+        STAT_ADD(MTP_Table[i], msgs_sent, 1);
+        STAT_ADD(MTP_Table[i], bytes_sent, KB);
+        MTP_Table[i].swnd.first_sent_ns[k] = now;
+    }
 
-                int left = curr_swnd.left_idx;
-                int right = curr_swnd.right_idx;
+    MTP_Table[i].swnd.last_sent_ns[k] = now;
+}
 
-                int is_tout = 0;
-                if ((right + 1) % SEND_BUFFSIZE == left)
-                {
-                    // SWND EMPTY
-                    up(mtx_sendbuf);
-                    up(mtx_swnd);
+/*
+    Function: serve_socket
+    Arguments: mtp_socket *MTP_Table, int i, int budget, int check_timeout
+    Return Value: int
+    Workflow: One turn of socket i in a DRR pass of S_Thread: sends at most budget messages of its window, under
+              mtx_swnd and mtx_sendbuf.
+              - A drained send buffer takes the socket out of the pending set.
+              - A local peer that advertised a full buffer is refreshed (its R_Thread gets no frames to do it).
+              - If check_timeout is set (every T / 2 seconds) and a sent message has waited more than T seconds,
+                the window is sent again from its left edge.
+              - The messages after last_sent are sent (a message sent before counts as a retransmission), with
+                UDP_OFFLOAD as one GSO send, and the ACK of a local peer is applied.
+              Returns the number of messages sent; less than budget means the socket has nothing more to send now.
+*/
+int serve_socket(mtp_socket *MTP_Table, int i, int budget, int check_timeout)
+{
+    mtp_buffers *MTP_Buff = MTP_BUFFERS(MTP_Table);
+    down(mtx_swnd);
+    down(mtx_sendbuf);
+    // Checking valid portion to send
+    send_window curr_swnd = MTP_Table[i].swnd;
 
-                    continue;
-                }
+    // Send buffer drained: leave the pending set until m_sendto adds the socket again. m_sendto stores the slot
+    // before it adds the socket, so a message it queued meanwhile is seen by the second look
+    if (slot_seq(&MTP_Buff[i].send_buff[curr_swnd.left_idx]) == -1)
+    {
+        socket_set_remove(&MTP_SHARED(MTP_Table)->pending_send, i);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (slot_seq(&MTP_Buff[i].send_buff[curr_swnd.left_idx]) != -1)
+            socket_set_add(&MTP_SHARED(MTP_Table)->pending_send, i);
+        up(mtx_sendbuf);
+        up(mtx_swnd);
+        return 0;
+    }
 
-                time_t curr_time = time(NULL);
+    int peer = find_local_peer(MTP_Table, i);
+    char local_ack[3] = {0, 0, 0};
 
-                while (left != (right + 1) % SEND_BUFFSIZE)
-                {
-                    if ((curr_time - curr_swnd.last_active_time[left] > T) && (curr_swnd.last_active_time[left] > 0) && (MTP_Table[i].send_buff[left].sequence_no > 0))
-                    {
-                        is_tout = 1;
-                        break;
-                    }
-                    left = (left + 1) % SEND_BUFFSIZE;
-                }
+    // A local peer that advertised a full buffer gets no frames to wake its R_Thread, so refresh it here
+    if (peer >= 0 && MTP_Table[peer].rwnd.nospace == 1)
+    {
+        char ACK_data[3];
+        down(mtx_recvbuf);
+        if (refresh_rwnd(MTP_Table, peer, ACK_data))
+        {
+            update_swnd_on_ack(MTP_Table, i, (int)(ACK_data[1] - 'a'), (int)(ACK_data[2] - 'a'));
+            curr_swnd = MTP_Table[i].swnd;
+        }
+        up(mtx_recvbuf);
+    }
 
-                // timeout occurred for some message
-                if (is_tout)
-                {
-                    left = curr_swnd.left_idx;
-                    right = curr_swnd.right_idx;
+    int left = curr_swnd.left_idx;
+    int right = curr_swnd.right_idx;
 
-                    while (left != (right + 1) % SEND_BUFFSIZE)
-                    {
-                        if (MTP_Table[i].send_buff[left].sequence_no < 0)
-                        {
-                            break;
-                        }
-                        char udp_data[KB + 2];
-                        udp_data[0] = 'D';
-                        udp_data[1] = (char)(MTP_Table[i].send_buff[left].sequence_no + 'a');
-                        my_strcpy(udp_data + 2, MTP_Table[i].send_buff[left].data, KB);
-                        struct sockaddr_in dest_addr = sock_converter(MTP_Table[i].dest_ip, MTP_Table[i].dest_port);
-                        int bytes = sendto(MTP_Table[i].udp_sockid, udp_data, KB + 2, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+    if ((right + 1) % SEND_BUFFSIZE == left)
+    {
+        // SWND EMPTY
+        up(mtx_sendbuf);
+        up(mtx_swnd);
+        return 0;
+    }
 
-                        total_message_sent++;
-                        printf("Total message sent : %d\n", total_message_sent);
+    if (check_timeout)
+    {
+        unsigned long long curr_time = monotonic_ns();
+        while (left != (right + 1) % SEND_BUFFSIZE)
+        {
+            if ((curr_time - curr_swnd.last_sent_ns[left] > T * 1000000000ULL) && (curr_swnd.last_sent_ns[left] > 0) && (slot_seq(&MTP_Buff[i].send_buff[left]) > 0))
+            {
+                // timeout occurred for some message: send the window again
+                STAT_ADD(MTP_Table[i], timeouts, 1);
+                MTP_Table[i].swnd.last_sent = (curr_swnd.left_idx - 1 + SEND_BUFFSIZE) % SEND_BUFFSIZE;
+                curr_swnd.last_sent = MTP_Table[i].swnd.last_sent;
+                break;
+            }
+            left = (left + 1) % SEND_BUFFSIZE;
+        }
+    }
 
-                        MTP_Table[i].swnd.last_active_time[left] = time(NULL);
+    left = (curr_swnd.last_sent + 1) % SEND_BUFFSIZE;
+    right = curr_swnd.right_idx;
+    int is_data_unsend = 1;
 
-                        MTP_Table[i].swnd.last_sent = left;
+    if (max_logical(left, right, SEND_BUFFSIZE) == left && left != right)
+    {
+        is_data_unsend = 0;
+    }
 
-                        left = (left + 1) % SEND_BUFFSIZE;
-                    }
-                }
-                else
-                {
-                    left = (curr_swnd.last_sent + 1) % SEND_BUFFSIZE;
-                    right = curr_swnd.right_idx;
-                    int is_data_unsend = 1;
+    int sent = 0;
+    while (left != (right + 1) % SEND_BUFFSIZE && is_data_unsend && sent < budget)
+    {
+        if (slot_seq(&MTP_Buff[i].send_buff[left]) < 0)
+        {
+            break;
+        }
+        transmit_message(MTP_Table, i, left, peer, local_ack, MTP_Table[i].swnd.last_sent_ns[left] != 0);
 
-                    if (max_logical(left, right, SEND_BUFFSIZE) == left && left != right)
-                    {
-                        is_data_unsend = 0;
-                    }
+        MTP_Table[i].swnd.last_sent = left;
 
-                    while (left != (right + 1) % SEND_BUFFSIZE && is_data_unsend)
-                    {
-                        if (MTP_Table[i].send_buff[left].sequence_no < 0)
-                        {
-                            break;
-                        }
-                        char udp_data[KB + 2];
-                        udp_data[0] = 'D';
-                        udp_data[1] = (char)(MTP_Table[i].send_buff[left].sequence_no + 'a');
-                        my_strcpy(udp_data + 2, MTP_Table[i].send_buff[left].data, KB);
-                        struct sockaddr_in dest_addr = sock_converter(MTP_Table[i].dest_ip, MTP_Table[i].dest_port);
-                        int bytes = sendto(MTP_Table[i].udp_sockid, udp_data, KB + 2, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+        left = (left + 1) % SEND_BUFFSIZE;
+        sent++;
+    }
+    // The frames of the window go out as one GSO send
+    if (thread_batch != NULL)
+        gso_flush();
 
-                        total_message_sent++;
-                        printf("Total message sent : %d\n", total_message_sent);
+    // ACK produced by a local peer through the fast path
+    if (local_ack[0] == 'A')
+    {
+        update_swnd_on_ack(MTP_Table, i, (int)(local_ack[1] - 'a'), (int)(local_ack[2] - 'a'));
+    }
+    up(mtx_sendbuf);
+    up(mtx_swnd);
+    return sent;
+}
 
-                        MTP_Table[i].swnd.last_active_time[left] = time(NULL);
+/*
+    Function: next_pending
+    Arguments: socket_set *set, int i, int start
+    Return Value: int
+    Workflow: Walks the pending set in a DRR pass from socket start round to start - 1: returns the socket after i
+              (the first one if i is -1), or -1 at the end of the pass.
+*/
+int next_pending(socket_set *set, int i, int start)
+{
+    int j = socket_set_next(set, (i < 0) ? start : i + 1, 0);
+    if (i < 0 || i >= start)
+    {
+        if (j >= 0)
+            return j;
+        j = socket_set_next(set, 0, 0);
+    }
+    return (j >= 0 && j < start) ? j : -1;
+}
 
-                        MTP_Table[i].swnd.last_sent = left;
+/*
+    Function: S_Thread
+    Arguments:
+        void *arg: A void pointer to the argument passed to the thread function.
+    Return Value: None (void *)
 
-                        left = (left + 1) % SEND_BUFFSIZE;
-                    }
-                }
-                up(mtx_sendbuf);
-                up(mtx_swnd);
+    Workflow:
+        - Extract the total shared resources from the argument.
+        - Initialize local pointers to the MTP socket table and shared variables.
+        - Enter an infinite loop for continuous operation.
+        - Serve the sockets with pending messages by deficit round robin, one pass per iteration: every socket earns
+          DRR_QUANTUM messages per unit of its weight (m_setweight) and sends at most its credit (serve_socket), so
+          a bulk transfer sends its window in slices between the messages of the other sockets. Credit a socket
+          could not use up is kept for the next pass; a socket with nothing more to send loses it. Each pass
+          starts one socket further on.
+        - Every T / 2 seconds (its own timer) a pass also checks each window for a timeout and resends it.
+        - With MTP_IO=uring, submit the frames queued in this pass at once.
+        - If a socket has used up its credit, start the next pass at once. Otherwise sleep on the send_waiter futex
+          until m_sendto, an ACK or m_recvfrom wakes it (send_wake), or until the next timeout check is due.
+*/
+void *S_Thread(void *arg)
+{
+    argtype *total_shared_resource = (argtype *)arg;
+    mtp_socket *MTP_Table = total_shared_resource->MTP_Table;
+
+    place_thread("S");
+    impair_thread = IMPAIR_S;
+    if (uring_wanted())
+        thread_uring = uring_open("S", 0);
+    if (UDP_OFFLOAD)
+        thread_batch = calloc(1, sizeof(gso_batch));
+    LOG(LOG_INFO, "S Thread ready to go...\n");
+
+    // Credit of each socket, kept across passes while it has more to send
+    int deficit[SIZE_SM] = {0};
+    int start = 0;
+    poll_waiter *waiter = &MTP_SHARED(MTP_Table)->send_waiter;
+    unsigned long long next_check_ns = monotonic_ns() + T * 500000000ULL;
+
+    while (1)
+    {
+        // read before the pass: a wakeup during it makes the FUTEX_WAIT below return at once
+        unsigned int seq = __atomic_load_n(&waiter->seq, __ATOMIC_SEQ_CST);
+        unsigned long long now = monotonic_ns();
+        int check_timeout = (now >= next_check_ns);
+        if (check_timeout)
+            next_check_ns = now + T * 500000000ULL;
+
+        socket_set *pending = &MTP_SHARED(MTP_Table)->pending_send;
+        int more = 0;
+        for (int i = next_pending(pending, -1, start); i >= 0; i = next_pending(pending, i, start))
+        {
+            if (MTP_Table[i].free)
+                continue;
+            int weight = MTP_Table[i].weight;
+            deficit[i] += DRR_QUANTUM * ((weight > 0) ? weight : 1);
+            int sent = serve_socket(MTP_Table, i, deficit[i], check_timeout);
+            if (sent < deficit[i])
+                deficit[i] = 0; // nothing more to send: no credit kept, as DRR does for an empty queue
+            else
+            {
+                deficit[i] -= sent;
+                more = 1;
             }
         }
-        // sleep time for S thread
-        sleep(T / 2);
+        // the next pass starts after the socket that went first in this one
+        start = (start + 1) % SIZE_SM;
+        int first = next_pending(pending, -1, start);
+        if (first >= 0)
+            start = first;
+
+        // Hand the frames of this pass to the kernel at once
+        if (thread_uring != NULL)
+        {
+            uring_submit(thread_uring, 0, 0);
+            uring_reap_sends(thread_uring);
+        }
+        if (more)
+            continue;
+
+        // Nothing more can be sent now: sleep until woken or the next timeout check
+        now = monotonic_ns();
+        if (now >= next_check_ns)
+            continue;
+        struct timespec wait = {.tv_sec = (next_check_ns - now) / 1000000000ULL, .tv_nsec = (next_check_ns - now) % 1000000000ULL};
+        __atomic_fetch_add(&waiter->waiting, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &waiter->seq, FUTEX_WAIT, seq, &wait, NULL, 0);
+        __atomic_fetch_sub(&waiter->waiting, 1, __ATOMIC_SEQ_CST);
     }
 }
 
@@ -833,6 +3381,60 @@ void *S_Thread(void *arg)
 
 /*----------------------------------------------------G THREAD----------------------------------------------------------*/
 
+/*
+    Function: owner_exited
+    Arguments: mtp_socket *MTP_Table, int i
+    Return Value: int
+    Workflow: Returns 1 if the process owning MTP socket i has exited, 0 if not, -1 if that can not be told.
+              With a pidfd the process has exited when the pidfd is readable (this includes a zombie not yet reaped
+              by its parent); otherwise kill(pid, 0) fails with ESRCH once the process is gone.
+*/
+int owner_exited(mtp_socket *MTP_Table, int i)
+{
+    if (owner_pidfd[i] >= 0)
+    {
+        struct pollfd pfd = {owner_pidfd[i], POLLIN, 0};
+        return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+    }
+    if (kill(MTP_Table[i].pid, 0) == 0)
+        return 0;
+    return (errno == ESRCH) ? 1 : -1;
+}
+
+/*
+    Function: owner_lingers
+    Arguments: mtp_socket *MTP_Table, int i
+    Return Value: int
+    Workflow: Returns 1 if MTP socket i, whose owner has exited, should be kept until its send buffer drains: a process
+              may exit right after m_sendto, and the daemon keeps sending for it as it did when exits were noticed
+              only every GARBAGE_T seconds. Gives up once the number of pending messages has not changed for LINGER_T
+              seconds (e.g. the peer is gone), like drain_inproc_engine. The socket is put back in the pending set,
+              in case its owner died between queueing a message and adding it. The caller holds mtx_table_info.
+*/
+int owner_lingers(mtp_socket *MTP_Table, int i)
+{
+    mtp_buffers *MTP_Buff = MTP_BUFFERS(MTP_Table);
+    int pending = 0;
+    down(mtx_sendbuf);
+    for (int k = 0; k < SEND_BUFFSIZE; k++)
+    {
+        if (slot_seq(&MTP_Buff[i].send_buff[k]) != -1)
+            pending++;
+    }
+    up(mtx_sendbuf);
+
+    if (pending == 0)
+        return 0;
+    socket_set_add(&MTP_SHARED(MTP_Table)->pending_send, i);
+    if (linger_since[i] == 0 || pending != linger_pending[i])
+    {
+        linger_pending[i] = pending;
+        linger_since[i] = time(NULL);
+        return 1;
+    }
+    return time(NULL) - linger_since[i] <= LINGER_T;
+}
+
 /*
     Function: G_Thread
     Arguments:
@@ -844,14 +3446,18 @@ void *S_Thread(void *arg)
         - Initialize local pointers to the MTP socket table and shared variables.
         - Enter an infinite loop for continuous operation.
         - Iterate over each socket ID in the MTP socket table.
-        - Check if the associated process exists using the kill system call.
-        - If the process exists, continue; otherwise, perform cleanup operations:
+        - Check if the associated process has exited (owner_exited: its pidfd, or the kill system call).
+        - If the process exists, add its pidfd to the descriptors to wait on. If it has exited but the socket still
+          has messages to send (owner_lingers), leave the socket to the S and R threads and check it again after
+          LINGER_CHECK_MS. Otherwise, perform cleanup operations:
             - Acquire mutex locks for the send and receive buffers.
             - Reset send window and send buffer variables.
             - Reset receive window and receive buffer variables.
-            - Set the socket as free and close its associated UDP socket.
+            - Set the socket as free and close its associated UDP socket and pidfd.
             - Release the mutex locks.
-        - Sleep for the specified garbage collection time.
+        - Wait with poll until one of the pidfds becomes readable (an owner exited), watch_owner signals the eventfd
+          (a new owner), or GARBAGE_T seconds have passed (for owners without a pidfd), so that the sockets of a process
+          are reclaimed within milliseconds of its exit.
 */
 void *G_Thread(void *arg)
 {
@@ -860,76 +3466,197 @@ void *G_Thread(void *arg)
     mtp_socket *MTP_Table = total_shared_resource->MTP_Table;
     shared_variables *shared_resource = total_shared_resource->shared_resource;
 
-    printf("G Thread ready to go...\n");
+    LOG(LOG_INFO, "G Thread ready to go...\n");
 
+    struct pollfd fds[SIZE_SM + 1];
     while (1)
     {
+        int n = 0;
+        int lingering = 0;
+        fds[n].fd = g_wakeup_fd;
+        fds[n++].events = POLLIN;
+
         down(mtx_table_info);
-        for (int i = 0; i < SIZE_SM; i++)
+        for_each_socket(i, &MTP_SHARED(MTP_Table)->active)
         {
             if (MTP_Table[i].free == 0)
             {
-                if (kill(MTP_Table[i].pid, 0) == 0)
+                int exited = owner_exited(MTP_Table, i);
+                if (exited == 0)
                 {
                     // process exists
+                    if (owner_pidfd[i] >= 0)
+                    {
+                        fds[n].fd = owner_pidfd[i];
+                        fds[n++].events = POLLIN;
+                    }
+                }
+                else if (exited == 1 && owner_lingers(MTP_Table, i))
+                {
+                    // process does not exist, but its messages are still being sent
+                    lingering = 1;
+                }
+                else if (exited == 1)
+                {
+                    // process does not exist
+                    linger_since[i] = 0;
+                    LOG(LOG_INFO, "Reclaiming socket %d of exited process %d\n", i, MTP_Table[i].pid);
+                    forget_peer(MTP_Table, i);
+                    unwatch_owner(i);
+                    reset_windows(MTP_Table, i);
+
+                    MTP_Table[i].free = 1;
+                    socket_set_remove(&MTP_SHARED(MTP_Table)->active, i);
+                    socket_set_remove(&MTP_SHARED(MTP_Table)->pending_send, i);
+                    release_udp_socket(MTP_Table, i);
                 }
                 else
                 {
-                    if (errno == ESRCH)
-                    {
-                        // process does not exist
-
-                        down(mtx_swnd);
-                        down(mtx_sendbuf);
-                        for (int k = 0; k < SEND_BUFFSIZE; k++)
-                        {
-                            MTP_Table[i].send_buff[k].sequence_no = -1;
-                        }
-                        MTP_Table[i].swnd.left_idx = 0;
-                        MTP_Table[i].swnd.right_idx = (RECV_BUFFSIZE - 1) % SEND_BUFFSIZE;
-                        MTP_Table[i].swnd.new_entry = 0;
-                        MTP_Table[i].swnd.last_seq_no = 0;
-                        MTP_Table[i].swnd.last_sent = -1;
-                        MTP_Table[i].swnd.last_ack_seqno = 0;
-                        for (int k = 0; k < SWND_SIZE; k++)
-                        {
-                            MTP_Table[i].swnd.last_active_time[k] = 0;
-                        }
-                        up(mtx_sendbuf);
-                        up(mtx_swnd);
-
-                        down(mtx_recvbuf);
-                        for (int k = 0; k < RECV_BUFFSIZE; k++)
-                        {
-                            MTP_Table[i].recv_buff[k].sequence_no = -1;
-                        }
-                        for (int k = 0; k < RWND_SIZE; k++)
-                        {
-                            MTP_Table[i].rwnd.window[k] = k + 1;
-                        }
-                        MTP_Table[i].rwnd.nospace = 0;
-                        MTP_Table[i].rwnd.last_inorder_received = 0;
-                        MTP_Table[i].rwnd.last_user_taken = 0;
-                        up(mtx_recvbuf);
-
-                        MTP_Table[i].free = 1;
-                        close(MTP_Table[i].udp_sockid);
-                    }
-                    else
-                    {
-                        up(mtx_table_info);
-                        perror("kill");
-                        pthread_exit(NULL);
-                    }
+                    up(mtx_table_info);
+                    LOG(LOG_ERROR, "kill: %s\n", strerror(errno));
+                    pthread_exit(NULL);
                 }
             }
         }
         up(mtx_table_info);
-        sleep(GARBAGE_T);
+
+        if (poll(fds, n, lingering ? LINGER_CHECK_MS : GARBAGE_T * 1000) > 0 && (fds[0].revents & POLLIN))
+        {
+            unsigned long long count;
+            if (read(g_wakeup_fd, &count, sizeof(count)) < 0)
+                LOG(LOG_WARN, "G Thread wakeup: %s\n", strerror(errno));
+        }
     }
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
 
+#ifdef MTP_INPROC
+mtp_socket *inproc_MTP_Table;
+
+/*
+    Function: drain_inproc_engine
+    Arguments: None
+    Return Value: void
+    Workflow: atexit handler of the in-process engine. The R and S threads die with the process, so it waits
+              while any socket still has unacknowledged messages in its send buffer, giving up once the
+              number of pending messages has not changed for LINGER_T seconds (e.g. the peer is gone).
+*/
+void drain_inproc_engine()
+{
+    mtp_buffers *inproc_MTP_Buff = MTP_BUFFERS(inproc_MTP_Table);
+    int last_pending = -1;
+    time_t last_progress = time(NULL);
+
+    while (1)
+    {
+        int pending = 0;
+        down(mtx_sendbuf);
+        for_each_socket(i, &MTP_SHARED(inproc_MTP_Table)->pending_send)
+        {
+            if (!inproc_MTP_Table[i].free)
+            {
+                for (int k = 0; k < SEND_BUFFSIZE; k++)
+                {
+                    if (slot_seq(&inproc_MTP_Buff[i].send_buff[k]) != -1)
+                        pending++;
+                }
+            }
+        }
+        up(mtx_sendbuf);
+
+        if (pending == 0)
+            break;
+        if (pending != last_pending)
+        {
+            last_pending = pending;
+            last_progress = time(NULL);
+        }
+        else if (time(NULL) - last_progress > LINGER_T)
+        {
+            break;
+        }
+        usleep(10000);
+    }
+}
+
+/*
+    Function: mtp_engine_start
+    Arguments: mtp_socket *MTP_Table, shared_variables *shared_resource
+    Return Value: void
+
+    Brief Workflow:
+        - Point the lock ids at the in-process mutexes.
+        - Initialize the process-private MTP socket table with default values, and the windows and buffers
+          of all sockets (reset_windows) before any request, rather than in R and S which may start late.
+        - Create detached threads for R, S, and G operations.
+        - Sleep briefly for thread initialization.
+        - Register drain_inproc_engine so queued messages are delivered before the process exits.
+        - Socket creation, binding and closing are served by process_request in the calling thread.
+*/
+void mtp_engine_start(mtp_socket *MTP_Table, shared_variables *shared_resource)
+{
+    mtx_table_info = LOCK_TABLE_INFO;
+    mtx_swnd = LOCK_SWND;
+    mtx_recvbuf = LOCK_RECVBUF;
+    mtx_sendbuf = LOCK_SENDBUF;
+    log_start();
+    impair_init_seed();
+    crc32c_init();
+
+    for (int i = 0; i < SIZE_SM; i++)
+    {
+        MTP_Table[i].free = 1;
+        MTP_Table[i].pid = i + 5;
+    }
+    socket_set_clear(&MTP_SHARED(MTP_Table)->active);
+    socket_set_clear(&MTP_SHARED(MTP_Table)->pending_send);
+    socket_set_clear(&MTP_SHARED(MTP_Table)->readable);
+    socket_set_clear(&MTP_SHARED(MTP_Table)->writable);
+    memset(MTP_SHARED(MTP_Table)->pollers, 0, sizeof(MTP_SHARED(MTP_Table)->pollers));
+    memset(MTP_SHARED(MTP_Table)->peers, 0, sizeof(MTP_SHARED(MTP_Table)->peers));
+
+    // initialize the windows and buffers of all sockets before the first request and before R and S start
+    for (int i = 0; i < SIZE_SM; i++)
+    {
+        reset_windows(MTP_Table, i);
+        owner_pidfd[i] = -1;
+    }
+    g_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    pthread_t R, S, G;
+
+    argtype *arg = (argtype *)malloc(sizeof(argtype));
+    arg->MTP_Table = MTP_Table;
+    arg->shared_resource = shared_resource;
+
+    if (pthread_create(&R, NULL, R_Thread, (void *)arg) != 0)
+    {
+        LOG(LOG_ERROR, "Failed to create R thread: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (pthread_create(&S, NULL, S_Thread, (void *)arg) != 0)
+    {
+        LOG(LOG_ERROR, "Failed to create S thread: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (pthread_create(&G, NULL, G_Thread, (void *)arg) != 0)
+    {
+        LOG(LOG_ERROR, "Failed to create G thread: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_detach(R);
+    pthread_detach(S);
+    pthread_detach(G);
+
+    usleep(100);
+
+    inproc_MTP_Table = MTP_Table;
+    atexit(drain_inproc_engine);
+}
+#else
 /*
     Function: main
     Arguments: None
@@ -937,16 +3664,18 @@ void *G_Thread(void *arg)
 
     Brief Workflow:
         - Register signal handler for SIGINT.
-        - Seed the random number generator.
+        - Name the IPC objects after the instance (MTP_INSTANCE).
+        - Seed the impairment emulator.
         - Initialize sembuf structures for P(s) and V(s) operations.
         - Create entry semaphore for synchronization.
         - Create exit semaphore for synchronization.
+        - Create shared memory for the MTP socket table (see create_shared_MTP_Table).
         - Create mutexes for thread synchronization.
-        - Create shared memory for the MTP socket table.
-        - Initialize the MTP socket table with default values.
+        - Initialize the MTP socket table with default values, and the windows and buffers of all sockets.
         - Create shared resources for communication with user processes.
         - Create threads for R, S, and G operations.
         - Sleep briefly for thread initialization.
+        - Mark the table ready in its header.
         - Handle socket operations for communication.
         - Join R, S, and G threads upon completion.
 */
@@ -954,7 +3683,15 @@ int main()
 {
 
     signal(SIGINT, sigint_handler);
-    srand(time(NULL));
+    log_start();
+    if (mtp_table_name(table_name) < 0)
+    {
+        LOG(LOG_ERROR, "Invalid MTP_INSTANCE: up to %d letters, digits, '-' or '_'\n", MTP_INSTANCE_MAX);
+        exit(EXIT_FAILURE);
+    }
+    snprintf(table_path, sizeof(table_path), "%s%s", MTP_HUGETLBFS, table_name);
+    impair_init_seed();
+    crc32c_init();
 
     // populating sembuf appropiately for P(s) and V(s)
     pop.sem_num = vop.sem_num = 0;
@@ -970,6 +3707,9 @@ int main()
     int exit_sem;
     create_exit_semaphore(&exit_sem);
 
+    /* Shared Memory creation (it holds the mutexes) */
+    mtp_socket *MTP_Table = create_shared_MTP_Table();
+
     create_mtx_table_info(&mtx_table_info);
 
     create_mutex_swnd(&mtx_swnd);
@@ -978,14 +3718,26 @@ int main()
 
     create_mutex_sendbuf(&mtx_sendbuf);
 
-    /* Shared Memory creation */
-    mtp_socket *MTP_Table = create_shared_MTP_Table();
     for (int i = 0; i < SIZE_SM; i++)
     {
         MTP_Table[i].free = 1;
         MTP_Table[i].pid = i + 5;
         // MTP_Table[i].udp_sockid = 256;
     }
+    socket_set_clear(&MTP_SHARED(MTP_Table)->active);
+    socket_set_clear(&MTP_SHARED(MTP_Table)->pending_send);
+    socket_set_clear(&MTP_SHARED(MTP_Table)->readable);
+    socket_set_clear(&MTP_SHARED(MTP_Table)->writable);
+    memset(MTP_SHARED(MTP_Table)->pollers, 0, sizeof(MTP_SHARED(MTP_Table)->pollers));
+    memset(MTP_SHARED(MTP_Table)->peers, 0, sizeof(MTP_SHARED(MTP_Table)->peers));
+
+    // initialize the windows and buffers of all sockets before the first request and before R and S start
+    for (int i = 0; i < SIZE_SM; i++)
+    {
+        reset_windows(MTP_Table, i);
+        owner_pidfd[i] = -1;
+    }
+    g_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
     /* Shared Resouces creation for communication with the user process */
     shared_variables *shared_resource = create_shared_variables();
@@ -999,46 +3751,50 @@ int main()
     // Create R thread
     if (pthread_create(&R, NULL, R_Thread, (void *)arg) != 0)
     {
-        perror("Failed to create R thread");
+        LOG(LOG_ERROR, "Failed to create R thread: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
     // Create S thread
     if (pthread_create(&S, NULL, S_Thread, (void *)arg) != 0)
     {
-        perror("Failed to create S thread");
+        LOG(LOG_ERROR, "Failed to create S thread: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
     // Create G thread
     if (pthread_create(&G, NULL, G_Thread, (void *)arg) != 0)
     {
-        perror("Failed to create S thread");
+        LOG(LOG_ERROR, "Failed to create S thread: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
     usleep(100);
 
+    // the table is ready: user processes may map it from now on
+    __atomic_store_n(&MTP_SHARED(MTP_Table)->header.magic, MTP_TABLE_MAGIC, __ATOMIC_RELEASE);
+
     socket_handler(MTP_Table, shared_resource, &entry_sem, &exit_sem);
 
     // Join R thread
     if (pthread_join(R, NULL) != 0)
     {
-        perror("Failed to join R thread");
+        LOG(LOG_ERROR, "Failed to join R thread: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
     // Join S thread
     if (pthread_join(S, NULL) != 0)
     {
-        perror("Failed to join S thread");
+        LOG(LOG_ERROR, "Failed to join S thread: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
     // Join G thread
     if (pthread_join(G, NULL) != 0)
     {
-        perror("Failed to join G thread");
+        LOG(LOG_ERROR, "Failed to join G thread: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 }
+#endif
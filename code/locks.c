@@ -0,0 +1,114 @@
+#include "msocket.h"
+
+/*
+    Locks of the MTP table. In the daemon build they are robust process-shared pthread mutexes in the MTP table
+    segment, taken by the library in the user processes and by the threads of initmsocket. If a process dies
+    holding one (killed inside m_socket while waiting for initmsocket, or inside m_close), the kernel hands the
+    mutex to the next locker with EOWNERDEAD, and lock_acquire repairs the state the dead process left:
+        - mtx_table_info: the request the dead process may have handed to initmsocket is waited for, and the
+          MTP sockets it was creating or closing are made consistent with the active set.
+    mtx_swnd, mtx_sendbuf and mtx_recvbuf only guard the reset of the windows of a socket its own process is closing,
+    so they only need to be made consistent. m_sendto and m_recvfrom take none of them: a message is handed over by one
+    store of its slot's sequence number (see BUFFER RINGS in msocket.h), so a process dying there leaves nothing half done.
+*/
+
+#ifndef MTP_INPROC
+/*
+    Function: lock_init
+    Arguments: int lock
+    Return Value: void
+    Workflow: Called by initmsocket at startup: initializes the mutex of a lock as process-shared and robust.
+*/
+void lock_init(int lock)
+{
+    robust_lock *l = &mtp_table_open()->locks[lock];
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&l->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    l->recovered = 0;
+}
+
+/*
+    Function: finish_request
+    Arguments: mtp_shared_table *shared
+    Return Value: void
+    Workflow: Recovery of mtx_table_info. If the dead process numbered a request that initmsocket has not served yet,
+              it may or may not have signalled the entry semaphore: signal it again and wait for the reply, so that
+              initmsocket is idle before the new holder writes the shared variables. initmsocket skips a request it
+              has already served, and call_daemon ignores replies to other requests, so a second signal is harmless.
+              Then a socket whose free flag disagrees with the active set was left by a dead m_socket (taken, but
+              never created by initmsocket: freed again) or m_close (freed, but not closed: left to G_Thread).
+*/
+static void finish_request(mtp_shared_table *shared)
+{
+    int sm_id = shmget(mtp_ipc_key(KEY_SHARED_RESOURCE), sizeof(shared_variables), 0777);
+    shared_variables *vars = (sm_id < 0) ? (void *)-1 : shmat(sm_id, 0, 0);
+    int entry_sem = semget(mtp_ipc_key(KEY_ENTRY_SEM), 1, 0777);
+    int exit_sem = semget(mtp_ipc_key(KEY_EXIT_SEM), 1, 0777);
+
+    if (vars != (void *)-1 && entry_sem >= 0 && exit_sem >= 0)
+    {
+        unsigned int request_no = __atomic_load_n(&vars->request_no, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&vars->reply_no, __ATOMIC_ACQUIRE) != request_no)
+        {
+            sem_up(entry_sem);
+            while (__atomic_load_n(&vars->reply_no, __ATOMIC_ACQUIRE) != request_no)
+                sem_down(exit_sem);
+        }
+    }
+    if (vars != (void *)-1)
+        shmdt(vars);
+
+    for (int i = 0; i < SIZE_SM; i++)
+    {
+        int active = socket_set_has(&shared->active, i);
+        if (!shared->sockets[i].free && !active)
+            shared->sockets[i].free = 1;
+        else if (shared->sockets[i].free && active)
+            shared->sockets[i].free = 0;
+    }
+}
+
+/*
+    Function: lock_acquire
+    Arguments: int lock
+    Return Value: int
+    Workflow: down() of the daemon build. Takes the mutex of the lock; if its owner died holding it, marks it
+              consistent and repairs what the owner left (the request of mtx_table_info) before returning, so the
+              caller sees the state as if the dead process had finished or never started.
+              The repair is redone by the next holder if this one dies during it. Returns 0, or the pthread error.
+*/
+int lock_acquire(int lock)
+{
+    mtp_shared_table *shared = mtp_table_open();
+    robust_lock *l = &shared->locks[lock];
+
+    int ret = pthread_mutex_lock(&l->mutex);
+    if (ret != EOWNERDEAD)
+        return ret;
+
+    pthread_mutex_consistent(&l->mutex);
+    __atomic_fetch_add(&l->recovered, 1, __ATOMIC_RELAXED);
+    if (lock == LOCK_TABLE_INFO)
+    {
+        finish_request(shared);
+    }
+    return 0;
+}
+
+/*
+    Function: lock_release
+    Arguments: int lock
+    Return Value: int
+    Workflow: up() of the daemon build.
+*/
+int lock_release(int lock)
+{
+    return pthread_mutex_unlock(&mtp_table_open()->locks[lock].mutex);
+}
+#endif
@@ -0,0 +1,138 @@
+#include "msocket.h"
+
+/*
+    Lock contention instrumentation. These functions are called by the down() and up() macros when the library and
+    initmsocket are built with -DMTP_LOCKSTAT; without it they are only used by mtplockstat to read the histograms.
+    The histograms are updated with relaxed atomic additions, since every process and thread using the locks
+    writes to them. The time a lock was taken is kept per thread, as a lock is released by the thread that took it.
+*/
+
+static const char *lock_names[NUM_LOCKS] = {"mtx_table_info", "mtx_swnd", "mtx_recvbuf", "mtx_sendbuf"};
+
+static lockstat_table *lockstat_shared = NULL;
+static __thread unsigned long long held_since[NUM_LOCKS];
+
+#ifdef MTP_INPROC
+static lockstat_table inproc_lockstat;
+#endif
+
+/*
+    Function: lockstat_attach
+    Arguments: None
+    Return Value: lockstat_table *
+    Workflow: Returns the lock histograms, attaching the shared memory segment (key KEY_LOCKSTAT of the instance)
+              the first time. In the in-process build they are in process-private memory. Returns NULL if the segment can not be attached.
+*/
+lockstat_table *lockstat_attach()
+{
+    if (lockstat_shared == NULL)
+    {
+#ifdef MTP_INPROC
+        lockstat_shared = &inproc_lockstat;
+#else
+        int sm_key = mtp_ipc_key(KEY_LOCKSTAT);
+        int sm_id = shmget(sm_key, sizeof(lockstat_table), 0777 | IPC_CREAT);
+        void *addr = shmat(sm_id, 0, 0);
+        if (addr == (void *)-1)
+            return NULL;
+        lockstat_shared = (lockstat_table *)addr;
+#endif
+    }
+    return lockstat_shared;
+}
+
+/*
+    Function: lockstat_index
+    Arguments: const char *name
+    Return Value: int
+    Workflow: Maps the name of the variable passed to down() or up() (possibly dereferenced, "*mtx_swnd") to
+              its lock id, or -1 for the semaphores that are not locks.
+*/
+int lockstat_index(const char *name)
+{
+    if (name[0] == '*')
+        name++;
+    for (int i = 0; i < NUM_LOCKS; i++)
+    {
+        if (strcmp(name, lock_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+    Function: lockstat_name
+    Arguments: int lock
+    Return Value: const char *
+    Workflow: Returns the name of the variable holding the id of a lock, as it is printed by mtplockstat.
+*/
+const char *lockstat_name(int lock)
+{
+    return lock_names[lock];
+}
+
+/*
+    Function: lockstat_now
+    Arguments: None
+    Return Value: unsigned long long
+    Workflow: Returns the current time of CLOCK_MONOTONIC in nanoseconds.
+*/
+unsigned long long lockstat_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+    Function: lockstat_bucket
+    Arguments: unsigned long long ns
+    Return Value: int
+    Workflow: Returns the log2 histogram bucket of a duration.
+*/
+static int lockstat_bucket(unsigned long long ns)
+{
+    int b = (ns == 0) ? 0 : 63 - __builtin_clzll(ns);
+    return (b < LOCKSTAT_BUCKETS) ? b : LOCKSTAT_BUCKETS - 1;
+}
+
+/*
+    Function: lockstat_acquired
+    Arguments: int lock, unsigned long long wait_start_ns
+    Return Value: void
+    Workflow: Called once down() has returned: records the wait since wait_start_ns and remembers when the
+              calling thread took the lock.
+*/
+void lockstat_acquired(int lock, unsigned long long wait_start_ns)
+{
+    lockstat_table *table;
+    if (lock < 0 || (table = lockstat_attach()) == NULL)
+        return;
+
+    unsigned long long now = lockstat_now();
+    lock_histogram *h = &table->locks[lock];
+    __atomic_fetch_add(&h->acquisitions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->wait_total_ns, now - wait_start_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->wait[lockstat_bucket(now - wait_start_ns)], 1, __ATOMIC_RELAXED);
+    held_since[lock] = now;
+}
+
+/*
+    Function: lockstat_released
+    Arguments: int lock
+    Return Value: void
+    Workflow: Called just before up(): records the time the calling thread held the lock.
+              An up() without a recorded down() in this thread is ignored.
+*/
+void lockstat_released(int lock)
+{
+    lockstat_table *table;
+    if (lock < 0 || held_since[lock] == 0 || (table = lockstat_attach()) == NULL)
+        return;
+
+    unsigned long long held = lockstat_now() - held_since[lock];
+    lock_histogram *h = &table->locks[lock];
+    __atomic_fetch_add(&h->hold_total_ns, held, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->hold[lockstat_bucket(held)], 1, __ATOMIC_RELAXED);
+    held_since[lock] = 0;
+}
@@ -2,24 +2,101 @@
 #define ERR -1
 #define SUCC 0
 
+#ifdef MTP_INPROC
+/*  In-process engine build: the table, the shared variables and the locks live in this process
+    and the R, S and G threads of initmsocket.c are started on the first socket call. */
+pthread_mutex_t inproc_locks[NUM_LOCKS] = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+                                           PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
+static mtp_shared_table inproc_memory;
+static shared_variables inproc_shared_resource;
+static pthread_once_t inproc_engine_once = PTHREAD_ONCE_INIT;
+
+static void start_inproc_engine()
+{
+    mtp_engine_start(inproc_memory.sockets, &inproc_shared_resource);
+}
+
+/*
+    Function: create_shared_MTP_Table
+    Arguments: None
+    Return Value: Pointer to mtp_socket
+    Workflow: Starts the in-process engine on first use and returns the process-private MTP table.
+*/
+mtp_socket *create_shared_MTP_Table()
+{
+    pthread_once(&inproc_engine_once, start_inproc_engine);
+    return inproc_memory.sockets;
+}
+
+/*
+    Function: create_shared_variables
+    Arguments: None
+    Return Value: Pointer to shared_variables
+    Workflow: Returns the process-private request block handed to process_request.
+*/
+shared_variables *create_shared_variables()
+{
+    return &inproc_shared_resource;
+}
+
+/*
+    Function: create_entry_semaphore, create_exit_semaphore
+    Arguments: Pointer to int id
+    Return Value: None
+    Workflow: Requests are served synchronously by process_request, so there is no handshake semaphore.
+*/
+void create_entry_semaphore(int *id)
+{
+    *id = -1;
+}
+
+void create_exit_semaphore(int *id)
+{
+    *id = -1;
+}
+
+/*
+    Function: create_mtx_table_info, create_mutex_swnd, create_mutex_recvbuf, create_mutex_sendbuf
+    Arguments: Pointer to int id
+    Return Value: None
+    Workflow: Stores the index of the corresponding pthread mutex in inproc_locks.
+*/
+void create_mtx_table_info(int *id)
+{
+    *id = LOCK_TABLE_INFO;
+}
+
+void create_mutex_swnd(int *id)
+{
+    *id = LOCK_SWND;
+}
+
+void create_mutex_recvbuf(int *id)
+{
+    *id = LOCK_RECVBUF;
+}
+
+void create_mutex_sendbuf(int *id)
+{
+    *id = LOCK_SENDBUF;
+}
+
+#else
 // sembuf
 struct sembuf pop, vop;
-#define down(s) semop(s, &pop, 1)   // wait(s)
-#define up(s) semop(s, &vop, 1)     // signal(s)
 
 
 /*
     Function: create_shared_MTP_Table
     Arguments: None
     Return Value: Pointer to mtp_socket
-    Workflow: Generates a shared memory key, creates or accesses shared memory segment for MTP table, attaches the segment, and returns the pointer to it.
+    Workflow: Returns the MTP table of initmsocket, mapped once per process by mtp_table_open (see table.c),
+              or NULL with errno set if initmsocket is not running or its table has another layout.
 */
 mtp_socket *create_shared_MTP_Table()
 {
-    int sm_key = ftok(".", KEY_MTP_TABLE);
-    int sm_id = shmget(sm_key, (SIZE_SM)*sizeof(mtp_socket), 0777|IPC_CREAT);
-    mtp_socket *MTP_Table = (mtp_socket *)shmat(sm_id, 0, 0);
-    return MTP_Table;
+    mtp_shared_table *shared = mtp_table_open();
+    return (shared == NULL) ? NULL : shared->sockets;
 }
 
 /*
@@ -30,8 +107,8 @@ mtp_socket *create_shared_MTP_Table()
 */
 shared_variables *create_shared_variables()
 {
-    int sm_key = ftok(".", KEY_SHARED_RESOURCE);
-    int sm_id_shared_vars = shmget(sm_key, sizeof(int), 0777|IPC_CREAT);
+    int sm_key = mtp_ipc_key(KEY_SHARED_RESOURCE);
+    int sm_id_shared_vars = shmget(sm_key, sizeof(shared_variables), 0777|IPC_CREAT);
     shared_variables *vars = (shared_variables *)shmat(sm_id_shared_vars, 0, 0);
     return vars;
 }
@@ -44,7 +121,7 @@ shared_variables *create_shared_variables()
 */
 void create_entry_semaphore(int *id)
 {
-    int sm_key = ftok(".", KEY_ENTRY_SEM);
+    int sm_key = mtp_ipc_key(KEY_ENTRY_SEM);
     *id = semget(sm_key, 1, 0777|IPC_CREAT);
 }
 
@@ -56,7 +133,7 @@ void create_entry_semaphore(int *id)
 */
 void create_exit_semaphore(int *id)
 {
-    int sm_key = ftok(".", KEY_EXIT_SEM);
+    int sm_key = mtp_ipc_key(KEY_EXIT_SEM);
     *id = semget(sm_key, 1, 0777|IPC_CREAT);
 }
 
@@ -64,48 +141,101 @@ void create_exit_semaphore(int *id)
     Function: create_mtx_table_info
     Arguments: Pointer to int id
     Return Value: None
-    Workflow: Generates a semaphore key, creates or accesses a semaphore for mutex table info, and stores its id in the provided pointer.
+    Workflow: Stores the lock id of the table info lock in the provided pointer; its robust mutex is in the MTP table (see locks.c).
 */
 void create_mtx_table_info(int *id)
 {
-    int sm_key = ftok(".", KEY_MUTEX);
-    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
+    *id = LOCK_TABLE_INFO;
 }
 
 /*
     Function: create_mutex_swnd
     Arguments: Pointer to int id
     Return Value: None
-    Workflow: Generates a semaphore key, creates or accesses a semaphore for mutex sliding window, and stores its id in the provided pointer.
+    Workflow: Stores the lock id of the sliding window lock in the provided pointer; its robust mutex is in the MTP table (see locks.c).
 */
 void create_mutex_swnd(int *id)
 {
-    int sm_key = ftok(".", KEY_MUTEX_SWND);
-    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
+    *id = LOCK_SWND;
 }
 
 /*
     Function: create_mutex_recvbuf
     Arguments: Pointer to int id
     Return Value: None
-    Workflow: Generates a semaphore key, creates or accesses a semaphore for mutex receive buffer, and stores its id in the provided pointer.
+    Workflow: Stores the lock id of the receive buffer lock in the provided pointer; its robust mutex is in the MTP table (see locks.c).
 */
 void create_mutex_recvbuf(int *id)
 {
-    int sm_key = ftok(".", KEY_MUTEX_RECVBUF);
-    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
+    *id = LOCK_RECVBUF;
 }
 
 /*
     Function: create_mutex_sendbuf
     Arguments: Pointer to int id
     Return Value: None
-    Workflow: Generates a semaphore key, creates or accesses a semaphore for mutex send buffer, and stores its id in the provided pointer.
+    Workflow: Stores the lock id of the send buffer lock in the provided pointer; its robust mutex is in the MTP table (see locks.c).
 */
 void create_mutex_sendbuf(int *id)
 {
-    int sm_key = ftok(".", KEY_MUTEX_SENDBUF);
-    *id = semget(sm_key, 1, 0777 | IPC_CREAT);
+    *id = LOCK_SENDBUF;
+}
+#endif
+
+/*
+    Function: init_sembuf
+    Arguments: None
+    Return Value: None
+    Workflow: Populates the sembuf structures for P(s) and V(s). Nothing to do when the locks are pthread mutexes.
+*/
+void init_sembuf()
+{
+#ifndef MTP_INPROC
+    pop.sem_num = vop.sem_num = 0;
+    pop.sem_flg = vop.sem_flg = 0;
+    pop.sem_op = -1;
+    vop.sem_op = 1;
+#endif
+}
+
+/*
+    Function: call_daemon
+    Arguments: mtp_socket *MTP_Table, shared_variables *shared_resource, int entry_sem, int exit_sem
+    Return Value: None
+    Workflow: Hands the request stored in shared_resource to initmsocket and waits for the reply.
+              The request is numbered, and the exit semaphore is waited on until initmsocket has served that number:
+              a process that died during an earlier request may have left a signal on it (see finish_request in locks.c).
+              In the in-process build the request is served directly by process_request.
+*/
+void call_daemon(mtp_socket *MTP_Table, shared_variables *shared_resource, int entry_sem, int exit_sem)
+{
+#ifdef MTP_INPROC
+    process_request(MTP_Table, shared_resource);
+#else
+    unsigned int request_no = shared_resource->request_no + 1;
+    __atomic_store_n(&shared_resource->request_no, request_no, __ATOMIC_RELEASE);
+    sem_up(entry_sem);
+    do
+    {
+        sem_down(exit_sem);
+    } while (__atomic_load_n(&shared_resource->reply_no, __ATOMIC_ACQUIRE) != request_no);
+#endif
+}
+
+/*
+    Function: detach_shared
+    Arguments: mtp_socket *MTP_Table, shared_variables *shared_resource
+    Return Value: None
+    Workflow: Detaches the shared variables segment. The MTP table stays mapped for the life of the process (see table.c).
+*/
+void detach_shared(mtp_socket *MTP_Table, shared_variables *shared_resource)
+{
+#ifndef MTP_INPROC
+    if(shared_resource != NULL)
+    {
+        shmdt(shared_resource);
+    }
+#endif
 }
 
 /*
@@ -166,12 +296,13 @@ int m_socket(int domain, int type, int protocol)
         return ERR;
     }
 
-    pop.sem_num = vop.sem_num = 0;
-    pop.sem_flg = vop.sem_flg = 0;
-    pop.sem_op = -1; 
-    vop.sem_op = 1;
+    init_sembuf();
 
     mtp_socket *MTP_Table = create_shared_MTP_Table();
+    if(MTP_Table == NULL)
+    {
+        return ERR;
+    }
     shared_variables *shared_resource = create_shared_variables();
 
     int entry_sem;
@@ -184,19 +315,18 @@ int m_socket(int domain, int type, int protocol)
     create_mtx_table_info(&mtx_table_info);
 
     down(mtx_table_info);
-    for (int i = 0; i < SIZE_SM; i++)
+    for_each_free_socket(i, &MTP_SHARED(MTP_Table)->active)
     {
         if(MTP_Table[i].free == 1)
         {
             int user_mtp_id = i;
-            MTP_Table[i].free = 0;
             MTP_Table[i].pid = getpid();
+            MTP_Table[i].free = 0;
             
             shared_resource->status = 0;
             shared_resource->mtp_id = user_mtp_id;
 
-            up(entry_sem);
-            down(exit_sem);
+            call_daemon(MTP_Table, shared_resource, entry_sem, exit_sem);
 
             if(shared_resource->error_no!=0)
             {
@@ -206,8 +336,7 @@ int m_socket(int domain, int type, int protocol)
                 return ERR;
             }
             
-            shmdt(MTP_Table);
-            shmdt(shared_resource);
+            detach_shared(MTP_Table, shared_resource);
 
             up(mtx_table_info);
             return user_mtp_id;
@@ -230,12 +359,14 @@ int m_socket(int domain, int type, int protocol)
 */
 int m_close(int socket_id)
 {
-    pop.sem_num = vop.sem_num = 0;
-    pop.sem_flg = vop.sem_flg = 0;
-    pop.sem_op = -1; 
-    vop.sem_op = 1;
+    init_sembuf();
 
     mtp_socket *MTP_Table = create_shared_MTP_Table();
+    if(MTP_Table == NULL)
+    {
+        return ERR;
+    }
+    mtp_buffers *MTP_Buff = MTP_BUFFERS(MTP_Table);
     shared_variables *shared_resource = create_shared_variables();
 
     int entry_sem;
@@ -259,7 +390,7 @@ int m_close(int socket_id)
         down(mtx_sendbuf);
         for (int k = 0; k < SEND_BUFFSIZE; k++)
         {
-            MTP_Table[socket_id].send_buff[k].sequence_no = -1;
+            MTP_Buff[socket_id].send_buff[k].sequence_no = -1;
         }
         MTP_Table[socket_id].swnd.left_idx = 0;
         MTP_Table[socket_id].swnd.right_idx = (RECV_BUFFSIZE - 1) % SEND_BUFFSIZE;
@@ -267,9 +398,9 @@ int m_close(int socket_id)
         MTP_Table[socket_id].swnd.last_seq_no = 0;
         MTP_Table[socket_id].swnd.last_sent = -1;
         MTP_Table[socket_id].swnd.last_ack_seqno = 0;
-        for (int k = 0; k < SWND_SIZE; k++)
+        for (int k = 0; k < SEND_BUFFSIZE; k++)
         {
-            MTP_Table[socket_id].swnd.last_active_time[k] = 0;
+            MTP_Table[socket_id].swnd.last_sent_ns[k] = 0;
         }
         up(mtx_sendbuf);
         up(mtx_swnd);
@@ -277,15 +408,12 @@ int m_close(int socket_id)
         down(mtx_recvbuf);
         for (int k = 0; k < RECV_BUFFSIZE; k++)
         {
-            MTP_Table[socket_id].recv_buff[k].sequence_no = -1;
-        }
-        for (int k = 0; k < RWND_SIZE; k++)
-        {
-            MTP_Table[socket_id].rwnd.window[k] = k + 1;
+            MTP_Buff[socket_id].recv_buff[k].sequence_no = rwnd_free_mark(k);
         }
+        MTP_Table[socket_id].rwnd.inserted = 0;
+        MTP_Table[socket_id].rwnd.consumed = 0;
         MTP_Table[socket_id].rwnd.nospace = 0;
         MTP_Table[socket_id].rwnd.last_inorder_received = 0;
-        MTP_Table[socket_id].rwnd.last_user_taken = 0;
         up(mtx_recvbuf);
 
         MTP_Table[socket_id].free = 1;
@@ -293,8 +421,7 @@ int m_close(int socket_id)
         
         shared_resource->status = 2;
 
-        up(entry_sem);
-        down(exit_sem);
+        call_daemon(MTP_Table, shared_resource, entry_sem, exit_sem);
 
         int retval = shared_resource->return_value;
 
@@ -307,8 +434,7 @@ int m_close(int socket_id)
         }
 
 
-        shmdt(MTP_Table);
-        shmdt(shared_resource);
+        detach_shared(MTP_Table, shared_resource);
 
         up(mtx_table_info);
         return retval;
@@ -327,12 +453,13 @@ int m_close(int socket_id)
 */
 int m_bind(int socket_id, char *src_ip, unsigned short int src_port, char *dest_ip, unsigned short int dest_port)
 {
-    pop.sem_num = vop.sem_num = 0;
-    pop.sem_flg = vop.sem_flg = 0;
-    pop.sem_op = -1; 
-    vop.sem_op = 1;
+    init_sembuf();
 
     mtp_socket *MTP_Table = create_shared_MTP_Table();
+    if(MTP_Table == NULL)
+    {
+        return ERR;
+    }
     shared_variables *shared_resource = create_shared_variables();
 
     int entry_sem;
@@ -358,8 +485,7 @@ int m_bind(int socket_id, char *src_ip, unsigned short int src_port, char *dest_
         shared_resource->src_addr.sin_family = AF_INET;
 
 
-        up(entry_sem);
-        down(exit_sem);
+        call_daemon(MTP_Table, shared_resource, entry_sem, exit_sem);
 
         int retval = shared_resource->return_value;
 
@@ -373,8 +499,61 @@ int m_bind(int socket_id, char *src_ip, unsigned short int src_port, char *dest_
         }
 
 
-        shmdt(MTP_Table);
-        shmdt(shared_resource);
+        detach_shared(MTP_Table, shared_resource);
+
+        up(mtx_table_info);
+        return retval;
+    }
+    up(mtx_table_info);
+    return ERR;
+}
+
+/*
+    Function: m_setimpair
+    Arguments: int socket_id, impair_config *config
+    Return Value: int
+    Workflow: Sets the network impairment (loss model, delay, jitter, reordering, duplication and bandwidth cap) applied
+              by initmsocket to the frames arriving at the given socket. The configuration is passed to initmsocket through
+              the shared variables like m_bind does, and initmsocket reseeds the socket's random state from config->seed
+              (or from its own seed if 0), so that runs with the same seeds see the same impairment.
+*/
+int m_setimpair(int socket_id, impair_config *config)
+{
+    init_sembuf();
+
+    mtp_socket *MTP_Table = create_shared_MTP_Table();
+    if(MTP_Table == NULL)
+    {
+        return ERR;
+    }
+    shared_variables *shared_resource = create_shared_variables();
+
+    int entry_sem;
+    create_entry_semaphore(&entry_sem);
+
+    int exit_sem;
+    create_exit_semaphore(&exit_sem);
+
+    int mtx_table_info;
+    create_mtx_table_info(&mtx_table_info);
+
+    down(mtx_table_info);
+    if(MTP_Table[socket_id].free == 0)
+    {
+        shared_resource->status = 3;
+        shared_resource->mtp_id = socket_id;
+        shared_resource->impair = *config;
+
+        call_daemon(MTP_Table, shared_resource, entry_sem, exit_sem);
+
+        int retval = shared_resource->return_value;
+
+        if(shared_resource->error_no!=0)
+        {
+            errno = shared_resource->error_no;
+        }
+
+        detach_shared(MTP_Table, shared_resource);
 
         up(mtx_table_info);
         return retval;
@@ -383,33 +562,280 @@ int m_bind(int socket_id, char *src_ip, unsigned short int src_port, char *dest_
     return ERR;
 }
 
+/*
+    Function: m_setstream
+    Arguments: int socket_id, int stream_id
+    Return Value: int
+    Workflow: Sets the stream id (0 to 255, 0 by default) of an MTP socket, to be called before m_bind.
+              With STREAM_MUX, MTP sockets bound to the same local address share one UDP socket and the frames carry
+              the stream id; both ends of a connection must use the same one, and two sockets of one address talking
+              to the same peer address need different ones. Without STREAM_MUX the stream id is ignored.
+*/
+int m_setstream(int socket_id, int stream_id)
+{
+    init_sembuf();
+
+    mtp_socket *MTP_Table = create_shared_MTP_Table();
+    if(MTP_Table == NULL)
+    {
+        return ERR;
+    }
+
+    int mtx_table_info;
+    create_mtx_table_info(&mtx_table_info);
+
+    if (stream_id < 0 || stream_id > 255)
+    {
+        errno = EINVAL;
+        detach_shared(MTP_Table, NULL);
+        return ERR;
+    }
+
+    down(mtx_table_info);
+    if(MTP_Table[socket_id].free == 0)
+    {
+        MTP_Table[socket_id].stream_id = stream_id;
+        detach_shared(MTP_Table, NULL);
+        up(mtx_table_info);
+        return 0;
+    }
+    detach_shared(MTP_Table, NULL);
+    up(mtx_table_info);
+    return ERR;
+}
+
+/*
+    Function: m_setcompress
+    Arguments: int socket_id, int on
+    Return Value: int
+    Workflow: Turns compression of the messages sent by an MTP socket on (on != 0) or off. initmsocket then compresses every
+              data frame it sends over UDP with its LZ compressor and sends it as a 'C' frame, unless it saves fewer than
+              LZ_MIN_GAIN bytes; the receiver decompresses 'C' frames whatever its own setting, so only the sender sets it.
+*/
+int m_setcompress(int socket_id, int on)
+{
+    init_sembuf();
+
+    mtp_socket *MTP_Table = create_shared_MTP_Table();
+    if(MTP_Table == NULL)
+    {
+        return ERR;
+    }
+
+    int mtx_table_info;
+    create_mtx_table_info(&mtx_table_info);
+
+    down(mtx_table_info);
+    if(MTP_Table[socket_id].free == 0)
+    {
+        MTP_Table[socket_id].compress = (on != 0);
+        detach_shared(MTP_Table, NULL);
+        up(mtx_table_info);
+        return 0;
+    }
+    detach_shared(MTP_Table, NULL);
+    up(mtx_table_info);
+    return ERR;
+}
+
+/*
+    Function: m_setweight
+    Arguments: int socket_id, int weight
+    Return Value: int
+    Workflow: Sets the weight of an MTP socket (1 to MTP_WEIGHT_MAX, 1 by default). S_Thread serves the sockets with
+              messages to send by deficit round robin, giving each DRR_QUANTUM * weight messages per pass, so a socket
+              of weight 4 gets four times the sending of a socket of weight 1 while both have messages waiting, and a
+              small flow is not held back by whole windows of a bulk transfer. Peers of a server socket get its weight.
+*/
+int m_setweight(int socket_id, int weight)
+{
+    init_sembuf();
+
+    mtp_socket *MTP_Table = create_shared_MTP_Table();
+    if(MTP_Table == NULL)
+    {
+        return ERR;
+    }
+
+    int mtx_table_info;
+    create_mtx_table_info(&mtx_table_info);
+
+    if (weight < 1 || weight > MTP_WEIGHT_MAX)
+    {
+        errno = EINVAL;
+        detach_shared(MTP_Table, NULL);
+        return ERR;
+    }
+
+    down(mtx_table_info);
+    if(MTP_Table[socket_id].free == 0)
+    {
+        MTP_Table[socket_id].weight = weight;
+        detach_shared(MTP_Table, NULL);
+        up(mtx_table_info);
+        return 0;
+    }
+    detach_shared(MTP_Table, NULL);
+    up(mtx_table_info);
+    return ERR;
+}
+
+/*
+    Function: m_listen
+    Arguments: int socket_id
+    Return Value: int
+    Workflow: Turns a bound MTP socket into a server socket, to be called after m_bind (whose destination is then
+              ignored). initmsocket gives every address that sends data to it an MTP socket of its own sharing the UDP
+              socket, with its own send and receive windows, found by address in the peer hash table.
+              m_recvfrom on the server socket returns the messages of all peers and fills in the sender in dest,
+              and m_sendto sends to any peer that has already sent something.
+*/
+int m_listen(int socket_id)
+{
+    init_sembuf();
+
+    mtp_socket *MTP_Table = create_shared_MTP_Table();
+    if(MTP_Table == NULL)
+    {
+        return ERR;
+    }
+    shared_variables *shared_resource = create_shared_variables();
+
+    int entry_sem;
+    create_entry_semaphore(&entry_sem);
+
+    int exit_sem;
+    create_exit_semaphore(&exit_sem);
+
+    int mtx_table_info;
+    create_mtx_table_info(&mtx_table_info);
+
+    down(mtx_table_info);
+    if(MTP_Table[socket_id].free == 0)
+    {
+        shared_resource->status = 4;
+        shared_resource->mtp_id = socket_id;
+
+        call_daemon(MTP_Table, shared_resource, entry_sem, exit_sem);
+
+        int retval = shared_resource->return_value;
+
+        if(shared_resource->error_no!=0)
+        {
+            errno = shared_resource->error_no;
+        }
+
+        detach_shared(MTP_Table, shared_resource);
+
+        up(mtx_table_info);
+        return retval;
+    }
+    up(mtx_table_info);
+    return ERR;
+}
+
+/*
+    Per-process guards of m_sendto and m_recvfrom. Each ring has one producer and one consumer (see BUFFER RINGS in
+    msocket.h): threads of the owner process that call m_sendto, or m_recvfrom, on the same MTP socket are serialized
+    by a mutex of the process, which costs no system call unless they collide.
+*/
+static pthread_mutex_t send_guard[SIZE_SM] = {[0 ... SIZE_SM - 1] = PTHREAD_MUTEX_INITIALIZER};
+static pthread_mutex_t recv_guard[SIZE_SM] = {[0 ... SIZE_SM - 1] = PTHREAD_MUTEX_INITIALIZER};
+
+/*
+    Function: send_ready
+    Arguments: mtp_socket *MTP_Table, int socket_id
+    Return Value: int
+    Workflow: Returns 1 if the next slot m_sendto fills in the send ring of the MTP socket is free.
+*/
+static int send_ready(mtp_socket *MTP_Table, int socket_id)
+{
+    return slot_seq(&MTP_BUFFERS(MTP_Table)[socket_id].send_buff[MTP_Table[socket_id].swnd.new_entry]) == -1;
+}
+
+/*
+    Function: recv_ready
+    Arguments: mtp_socket *MTP_Table, int socket_id
+    Return Value: int
+    Workflow: Returns 1 if the head slot of the receive ring of the MTP socket holds a message, or for a server
+              socket (m_listen) if the ring of one of its peers does.
+*/
+static int recv_ready(mtp_socket *MTP_Table, int socket_id)
+{
+    if(MTP_Table[socket_id].server == socket_id)
+    {
+        for(int j = 0; j < SIZE_SM; j++)
+        {
+            if(j != socket_id && !MTP_Table[j].free && MTP_Table[j].server == socket_id && recv_ready(MTP_Table, j))
+                return 1;
+        }
+        return 0;
+    }
+    unsigned long long consumed = __atomic_load_n(&MTP_Table[socket_id].rwnd.consumed, __ATOMIC_RELAXED);
+    return slot_seq(&MTP_BUFFERS(MTP_Table)[socket_id].recv_buff[rwnd_head(consumed)]) > 0;
+}
+
+/*
+    Function: clear_ready
+    Arguments: mtp_socket *MTP_Table, socket_set *set, int socket_id, int (*ready)(mtp_socket *, int)
+    Return Value: void
+    Workflow: Removes the MTP socket from the readable or writable set of m_poll, and adds it back if ready finds
+              it ready after all. The daemon stores the slot that makes a socket ready before it adds the socket
+              (mark_ready), and this looks at the slot after the removal, so a socket is never left out of the set
+              when a slot became ready meanwhile.
+*/
+static void clear_ready(mtp_socket *MTP_Table, socket_set *set, int socket_id, int (*ready)(mtp_socket *, int))
+{
+    socket_set_remove(set, socket_id);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(ready(MTP_Table, socket_id))
+    {
+        socket_set_add(set, socket_id);
+    }
+}
+
 /*
     Function: m_sendto
     Arguments: int socket_id, char *buffer, int size, int flags, struct sockaddr *dest, int len
     Return Value: int
-    Workflow: Sends data over the MTP socket to the specified destination. It initializes necessary shared resources,
-              creates mutexes, and locks the send buffer and sliding window. It checks if the destination IP address and port
-              match the stored values in the MTP table. If not, it returns an error. It then checks if there is space in the
-              send buffer. If not, it returns an error. Otherwise, it copies the data to the send buffer, assigns a sequence
-              number, and updates the sliding window. Afterward, it releases the locks and detaches shared memory.
+    Workflow: Sends data over the MTP socket to the specified destination. It checks if the destination IP address and port
+              match the stored values in the MTP table. If not, it returns an error. It then checks if the next slot of the
+              send ring is free. If not, it returns an error. Otherwise, it copies the data to the slot, assigns a sequence
+              number, and stores it in the slot, which hands the message to S_Thread, wakes S_Thread and returns size.
+              On a server socket (m_listen) the message goes into the send buffer of the MTP socket of the peer dest,
+              looked up in the peer hash table; it fails with ENOTCONN if dest has not sent anything yet.
+              No lock of the MTP table is taken (see BUFFER RINGS in msocket.h): a process that dies in m_sendto
+              has queued the message completely or not at all.
 */
 int m_sendto(int socket_id, char *buffer, int size, int flags, struct sockaddr *dest, int len)
 {
-    pop.sem_num = vop.sem_num = 0;
-    pop.sem_flg = vop.sem_flg = 0;
-    pop.sem_op = -1; 
-    vop.sem_op = 1;
+    init_sembuf();
 
     mtp_socket *MTP_Table = create_shared_MTP_Table();
-    shared_variables *shared_resource = create_shared_variables();
+    if(MTP_Table == NULL)
+    {
+        return ERR;
+    }
+    mtp_buffers *MTP_Buff = MTP_BUFFERS(MTP_Table);
 
-    int mtx_sendbuf;
-    create_mutex_sendbuf(&mtx_sendbuf);
+    struct sockaddr_in *dest_in = (struct sockaddr_in *)dest;
 
-    int mtx_swnd;
-    create_mutex_swnd(&mtx_swnd);
+    if(MTP_Table[socket_id].server == socket_id)
+    {
+        int mtx_table_info;
+        create_mtx_table_info(&mtx_table_info);
+
+        down(mtx_table_info);
+        int peer = peer_hash_find(MTP_SHARED(MTP_Table)->peers, socket_id, dest_in->sin_addr.s_addr, dest_in->sin_port);
+        up(mtx_table_info);
+        if(peer < 0)
+        {
+            errno = ENOTCONN;
+            return ERR;
+        }
+        socket_id = peer;
+    }
 
-    struct sockaddr_in *dest_in = (struct sockaddr_in *)dest;
     char *given_dest_ip = inet_ntoa(dest_in->sin_addr);
     unsigned short given_dest_port = ntohs(dest_in->sin_port);
 
@@ -419,80 +845,284 @@ int m_sendto(int socket_id, char *buffer, int size, int flags, struct sockaddr *
         return ERR;
     }
 
-    down(mtx_swnd);
-    down(mtx_sendbuf);
-    if(MTP_Table[socket_id].send_buff[MTP_Table[socket_id].swnd.new_entry].sequence_no != -1)
+    pthread_mutex_lock(&send_guard[socket_id]);
+    send_window *swnd = &MTP_Table[socket_id].swnd;
+    int idx = swnd->new_entry;
+    message *slot = &MTP_Buff[socket_id].send_buff[idx];
+    if(slot_seq(slot) != -1)
     {
         errno = ENOBUFS;
-        up(mtx_sendbuf);
-        up(mtx_swnd);
-        shmdt(MTP_Table);
-        shmdt(shared_resource);
-
+        STAT_ADD(MTP_Table[socket_id], sendbuf_full, 1);
+        clear_ready(MTP_Table, &MTP_SHARED(MTP_Table)->writable, socket_id, send_ready);
+        pthread_mutex_unlock(&send_guard[socket_id]);
         return ERR;
     }
 
-    int idx = MTP_Table[socket_id].swnd.new_entry;
-    my_strcpy(MTP_Table[socket_id].send_buff[idx].data, buffer, KB);
-    MTP_Table[socket_id].send_buff[idx].sequence_no = (MTP_Table[socket_id].swnd.last_seq_no)%MAX_SEQ_NO + 1;
-    MTP_Table[socket_id].swnd.last_seq_no = MTP_Table[socket_id].send_buff[idx].sequence_no;
-    MTP_Table[socket_id].swnd.new_entry = (MTP_Table[socket_id].swnd.new_entry+1)%SEND_BUFFSIZE;
+    // the slot is free until its sequence number is set, so the data goes in first
+    my_strcpy(slot->data, buffer, KB);
+    int seq = (swnd->last_seq_no)%MAX_SEQ_NO + 1;
+    swnd->last_seq_no = seq;
+    __atomic_store_n(&swnd->new_entry, (idx + 1) % SEND_BUFFSIZE, __ATOMIC_RELAXED);
+    slot_set(slot, seq);
+    socket_set_add(&MTP_SHARED(MTP_Table)->pending_send, socket_id);
+    send_wake(&MTP_SHARED(MTP_Table)->send_waiter);
+    if(!send_ready(MTP_Table, socket_id))
+    {
+        clear_ready(MTP_Table, &MTP_SHARED(MTP_Table)->writable, socket_id, send_ready);
+    }
+    pthread_mutex_unlock(&send_guard[socket_id]);
 
-    shmdt(MTP_Table);
-    shmdt(shared_resource);
+    return size;
+}
 
-    up(mtx_sendbuf);
-    up(mtx_swnd);
+/*
+    Function: fill_sender
+    Arguments: mtp_socket *MTP_Table, int socket_id, struct sockaddr *dest, int *len
+    Return Value: void
+    Workflow: Stores the destination address of the MTP socket, which is the sender of the messages it receives,
+              in dest (truncated to *len bytes) and its size in *len, if dest and len are given.
+*/
+static void fill_sender(mtp_socket *MTP_Table, int socket_id, struct sockaddr *dest, int *len)
+{
+    if(dest == NULL || len == NULL)
+        return;
+
+    struct sockaddr_in sender;
+    memset(&sender, 0, sizeof(sender));
+    sender.sin_family = AF_INET;
+    sender.sin_addr.s_addr = inet_addr(MTP_Table[socket_id].dest_ip);
+    sender.sin_port = htons(MTP_Table[socket_id].dest_port);
+    memcpy(dest, &sender, min(*len, (int)sizeof(sender)));
+    *len = sizeof(sender);
+}
+
+/*
+    Function: take_message
+    Arguments: mtp_socket *MTP_Table, int socket_id, char *buffer, int size
+    Return Value: int
+    Workflow: Takes the next in-order message of the MTP socket, which is always in the head slot of the receive ring,
+              if it has arrived, and removes the socket from the readable set of m_poll once the ring has no next message.
+              The slot is given back to R_Thread with the free mark of the message that goes in it next before the
+              consumed count moves, so R_Thread never puts a message in a slot that is still being read.
+              If the socket had advertised a full buffer S_Thread is woken, since it refreshes the window of a local peer.
+              The caller holds the recv_guard of the socket. Returns KB, or ERR if the message is not there.
+*/
+static int take_message(mtp_socket *MTP_Table, int socket_id, char *buffer, int size)
+{
+    mtp_buffers *MTP_Buff = MTP_BUFFERS(MTP_Table);
+
+    unsigned long long consumed = MTP_Table[socket_id].rwnd.consumed;
+    message *slot = &MTP_Buff[socket_id].recv_buff[rwnd_head(consumed)];
+    if(slot_seq(slot) == rwnd_last_taken(consumed)%MAX_SEQ_NO+1)
+    {
+        my_strcpy(buffer, slot->data, min(KB,size));
+        slot_set(slot, rwnd_free_mark(consumed + RECV_BUFFSIZE));
+        __atomic_store_n(&MTP_Table[socket_id].rwnd.consumed, consumed + 1, __ATOMIC_RELEASE);
+        // a local peer waits for S_Thread to see the space (serve_socket refreshes it)
+        if(__atomic_load_n(&MTP_Table[socket_id].rwnd.nospace, __ATOMIC_RELAXED))
+        {
+            send_wake(&MTP_SHARED(MTP_Table)->send_waiter);
+        }
+        if(!recv_ready(MTP_Table, socket_id))
+        {
+            clear_ready(MTP_Table, &MTP_SHARED(MTP_Table)->readable, socket_id, recv_ready);
+        }
+        return KB;
+    }
+    clear_ready(MTP_Table, &MTP_SHARED(MTP_Table)->readable, socket_id, recv_ready);
+    return ERR;
 }
 
 /*
     Function: m_recvfrom
     Arguments: int socket_id, char *buffer, int size, int flags, struct sockaddr *dest, int *len
     Return Value: int
-    Workflow: Receives data from the MTP socket. It initializes necessary shared resources, creates a mutex for the receive buffer,
-              and locks it. It finds the minimum sequence number expected to be received and searches the receive buffer for data
-              with that sequence number. If found, it copies the data to the buffer provided, updates the last user-taken sequence
-              number, releases the lock, and returns the size of the data copied. If no message is available, it returns an error.
+    Workflow: Receives data from the MTP socket. It takes the next in-order message with take_message, fills in its
+              sender in dest and returns the size of the data copied. If no message is available, it returns an error.
+              No lock of the MTP table is taken (see BUFFER RINGS in msocket.h).
+              On a server socket (m_listen) it looks at the MTP sockets of its peers in turn, starting after the
+              one that gave the previous message, so that a busy peer cannot starve the others.
 */
 int m_recvfrom(int socket_id, char *buffer, int size, int flags, struct sockaddr *dest, int *len)
 {
-    pop.sem_num = vop.sem_num = 0;
-    pop.sem_flg = vop.sem_flg = 0;
-    pop.sem_op = -1; 
-    vop.sem_op = 1;
+    init_sembuf();
 
     mtp_socket *MTP_Table = create_shared_MTP_Table();
-    shared_variables *shared_resource = create_shared_variables();
-
-    int mtx_recvbuf;
-    create_mutex_recvbuf(&mtx_recvbuf);
+    if(MTP_Table == NULL)
+    {
+        return ERR;
+    }
 
-    down(mtx_recvbuf);
-    int min_seqno = (MTP_Table[socket_id].rwnd.last_user_taken)%MAX_SEQ_NO+1;
-    for(int i=0; i<RECV_BUFFSIZE; i++)
+    pthread_mutex_lock(&recv_guard[socket_id]);
+    if(MTP_Table[socket_id].server == socket_id)
     {
-        if(MTP_Table[socket_id].recv_buff[i].sequence_no == min_seqno)
+        int start = MTP_Table[socket_id].next_peer;
+        for(int n = 0; n < SIZE_SM; n++)
         {
-            my_strcpy(buffer, MTP_Table[socket_id].recv_buff[i].data, min(KB,size));
-            MTP_Table[socket_id].recv_buff[i].sequence_no = -1;
-            MTP_Table[socket_id].rwnd.last_user_taken = min_seqno;
-            // if (MTP_Table[socket_id].rwnd.nospace==1)
-            // {
-            //     // no space
-            // }
-            shmdt(MTP_Table);
-            shmdt(shared_resource);
-            up(mtx_recvbuf);
-            return KB;
+            int j = (start + n) % SIZE_SM;
+            if(j == socket_id || MTP_Table[j].free || MTP_Table[j].server != socket_id)
+                continue;
+            if(take_message(MTP_Table, j, buffer, size) != ERR)
+            {
+                MTP_Table[socket_id].next_peer = (j + 1) % SIZE_SM;
+                fill_sender(MTP_Table, j, dest, len);
+                pthread_mutex_unlock(&recv_guard[socket_id]);
+                return KB;
+            }
         }
+        // none of the peers has a message
+        clear_ready(MTP_Table, &MTP_SHARED(MTP_Table)->readable, socket_id, recv_ready);
+    }
+    else if(take_message(MTP_Table, socket_id, buffer, size) != ERR)
+    {
+        fill_sender(MTP_Table, socket_id, dest, len);
+        pthread_mutex_unlock(&recv_guard[socket_id]);
+        return KB;
     }
     errno = ENOMSG;
-    up(mtx_recvbuf);
-    shmdt(MTP_Table);
-    shmdt(shared_resource);
+    pthread_mutex_unlock(&recv_guard[socket_id]);
     return ERR;
 }
 
+/*
+    Function: poll_slot
+    Arguments: mtp_socket *MTP_Table
+    Return Value: int
+    Workflow: Returns the m_poll wakeup slot of the calling process, claiming a free one (or one of a process that no
+              longer exists) with a compare-and-swap on its pid the first time. Returns -1 if all MAX_POLLERS slots are taken.
+*/
+static int poll_slot(mtp_socket *MTP_Table)
+{
+    static int my_slot = -1;
+    static pid_t my_pid = 0;
+
+    poll_waiter *pollers = MTP_SHARED(MTP_Table)->pollers;
+    pid_t pid = getpid();
+    if(my_slot >= 0 && my_pid == pid && __atomic_load_n(&pollers[my_slot].pid, __ATOMIC_ACQUIRE) == pid)
+    {
+        return my_slot;
+    }
+
+    for(int k = 0; k < MAX_POLLERS; k++)
+    {
+        pid_t owner = __atomic_load_n(&pollers[k].pid, __ATOMIC_ACQUIRE);
+        if(owner == pid ||
+           ((owner == 0 || (kill(owner, 0) < 0 && errno == ESRCH)) &&
+            __atomic_compare_exchange_n(&pollers[k].pid, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)))
+        {
+            my_slot = k;
+            my_pid = pid;
+            return k;
+        }
+    }
+    return -1;
+}
+
+/*
+    Function: m_poll
+    Arguments: struct m_pollfd *fds, int n, int timeout_ms
+    Return Value: int
+    Workflow: Waits until one of the n MTP sockets is ready for the events asked for (M_POLLIN: m_recvfrom has a message,
+              M_POLLOUT: m_sendto has space), or for timeout_ms milliseconds (forever if negative, not at all if 0), like poll.
+              Readiness is read from the readable and writable sets, which initmsocket updates when a message arrives or an
+              ACK frees the send buffer and m_recvfrom and m_sendto update when they empty or fill the buffers. The sockets
+              are tagged with the poller slot of the process, and initmsocket wakes the slot's futex when one of them becomes
+              ready, so the call sleeps in the kernel instead of spinning. A server socket (m_listen) is readable when one of
+              its peers is and always writable. Returns the number of entries with revents set, 0 on timeout, or ERR.
+*/
+int m_poll(struct m_pollfd *fds, int n, int timeout_ms)
+{
+    init_sembuf();
+
+    mtp_socket *MTP_Table = create_shared_MTP_Table();
+    if(MTP_Table == NULL)
+    {
+        return ERR;
+    }
+    mtp_shared_table *shared = MTP_SHARED(MTP_Table);
+
+    int slot = poll_slot(MTP_Table);
+    if(slot < 0)
+    {
+        errno = ENOMEM;
+        detach_shared(MTP_Table, NULL);
+        return ERR;
+    }
+    poll_waiter *waiter = &shared->pollers[slot];
+
+    for(int k = 0; k < n; k++)
+    {
+        if(fds[k].fd >= 0 && fds[k].fd < SIZE_SM)
+        {
+            MTP_Table[fds[k].fd].poller = slot;
+        }
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if(timeout_ms > 0)
+    {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    while(1)
+    {
+        // read the sequence number before the sets, so that a wakeup after the check makes FUTEX_WAIT return at once
+        unsigned int seq = __atomic_load_n(&waiter->seq, __ATOMIC_SEQ_CST);
+
+        int ready = 0;
+        for(int k = 0; k < n; k++)
+        {
+            int fd = fds[k].fd;
+            fds[k].revents = 0;
+            if(fd < 0)
+                continue;
+            if(fd >= SIZE_SM || MTP_Table[fd].free)
+                fds[k].revents = M_POLLNVAL;
+            else
+            {
+                if((fds[k].events & M_POLLIN) && socket_set_has(&shared->readable, fd))
+                    fds[k].revents |= M_POLLIN;
+                if((fds[k].events & M_POLLOUT) && socket_set_has(&shared->writable, fd))
+                    fds[k].revents |= M_POLLOUT;
+            }
+            if(fds[k].revents)
+                ready++;
+        }
+        if(ready > 0 || timeout_ms == 0)
+        {
+            detach_shared(MTP_Table, NULL);
+            return ready;
+        }
+
+        struct timespec wait_time, *wait = NULL;
+        if(timeout_ms > 0)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long left_ns = (deadline.tv_sec - now.tv_sec) * 1000000000LL + (deadline.tv_nsec - now.tv_nsec);
+            if(left_ns <= 0)
+            {
+                detach_shared(MTP_Table, NULL);
+                return 0;
+            }
+            wait_time.tv_sec = left_ns / 1000000000LL;
+            wait_time.tv_nsec = left_ns % 1000000000LL;
+            wait = &wait_time;
+        }
+
+        __atomic_fetch_add(&waiter->waiting, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &waiter->seq, FUTEX_WAIT, seq, wait, NULL, 0);
+        __atomic_fetch_sub(&waiter->waiting, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
 /*
     Function: printTable
     Arguments: None
@@ -503,6 +1133,11 @@ int m_recvfrom(int socket_id, char *buffer, int size, int flags, struct sockaddr
 void printTable()
 {
     mtp_socket *MTP_Table = create_shared_MTP_Table();
+    if(MTP_Table == NULL)
+    {
+        perror("MTP table");
+        return;
+    }
     printf("-----------------------------------------\n");
     printf("MTP_ID\tpid\tfree\tudp_sockid\n");
     for(int i=0; i<SIZE_SM; i++)
@@ -514,26 +1149,56 @@ void printTable()
 }
 
 /*
-    Function: dropMessage
-    Arguments: float p
-    Return Value: int
-    Workflow: Simulates dropping a message with a given probability. It generates a random number between 0 and 1,
-              compares it with the given probability p. If the random number is less than p, it returns 1 indicating
-              success (message dropped). Otherwise, it returns 0 indicating failure (message not dropped).
+    Function: printStats
+    Arguments: None
+    Return Value: void
+    Workflow: Prints the counters of every MTP socket in use (see mtp_stats), with the number of messages waiting in its
+              send and receive buffers. The counters are read with relaxed atomic loads and the buffers without locks,
+              so each line is a consistent enough snapshot to spot a stalling connection without stopping the daemon.
 */
-int dropMessage(float p)
+void printStats()
 {
-    srand(time(NULL));
-    float random_number = (float)(rand() )/RAND_MAX;
-    
-    if (random_number < p) 
+    mtp_socket *MTP_Table = create_shared_MTP_Table();
+    if(MTP_Table == NULL)
     {
-        return 1;
+        perror("MTP table");
+        return;
     }
-    else
+    mtp_buffers *MTP_Buff = MTP_BUFFERS(MTP_Table);
+
+    printf("%-3s %-7s %-21s %-21s %8s %10s %10s %6s %6s %6s %8s %10s %6s %6s %6s %6s %6s %6s %8s %8s %8s %3s %5s %5s\n",
+           "id", "pid", "local", "remote", "sent", "bytes_out", "wire_out", "cmpr", "retx", "tout", "recv", "bytes_in",
+           "dupack", "drop", "crc", "disc", "sbfull", "rwfull", "rtt_us", "rttvar", "rttmin", "wt", "sendq", "recvq");
+    for_each_socket(i, &MTP_SHARED(MTP_Table)->active)
     {
-        return 0;
-    }
-}
+        if (MTP_Table[i].free)
+            continue;
 
+        mtp_stats st;
+        unsigned long long *src = (unsigned long long *)&MTP_Table[i].stats;
+        unsigned long long *dst = (unsigned long long *)&st;
+        for (int k = 0; k < (int)(sizeof(mtp_stats) / sizeof(unsigned long long)); k++)
+        {
+            dst[k] = __atomic_load_n(&src[k], __ATOMIC_RELAXED);
+        }
 
+        int sendq = 0;
+        for (int k = 0; k < SEND_BUFFSIZE; k++)
+        {
+            if (MTP_Buff[i].send_buff[k].sequence_no != -1)
+                sendq++;
+        }
+        int recvq = (int)(MTP_Table[i].rwnd.inserted - MTP_Table[i].rwnd.consumed);
+
+        char local[32], remote[32];
+        snprintf(local, sizeof(local), "%s:%d", inet_ntoa(MTP_Table[i].src_addr.sin_addr), ntohs(MTP_Table[i].src_addr.sin_port));
+        snprintf(remote, sizeof(remote), "%s:%d", MTP_Table[i].dest_ip, MTP_Table[i].dest_port);
+
+        printf("%-3d %-7d %-21s %-21s %8llu %10llu %10llu %6llu %6llu %6llu %8llu %10llu %6llu %6llu %6llu %6llu %6llu %6llu %8llu %8llu %8llu %3d %5d %5d\n",
+               i, MTP_Table[i].pid, local, remote, st.msgs_sent, st.bytes_sent, st.wire_bytes, st.compressed, st.retransmissions, st.timeouts,
+               st.msgs_received, st.bytes_received, st.dup_acks, st.drops, st.crc_errors, st.discarded, st.sendbuf_full, st.rwnd_full,
+               st.rtt_us, st.rtt_var_us, st.rtt_min_us, MTP_Table[i].weight, sendq, recvq);
+    }
+
+    detach_shared(MTP_Table, NULL);
+}
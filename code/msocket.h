@@ -14,12 +14,40 @@
 #include <sys/shm.h>
 #include <time.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctype.h>
 
 /*----------------- MACROS -----------------*/
 #define SOCK_MTP 115
-#define P 0.1 // Probability of dropping a message
+#define P 0.1 // Default probability of dropping a message (see impair_config)
+#ifndef LOCAL_FASTPATH
+#define LOCAL_FASTPATH 1 // Deliver frames directly between MTP sockets of the same daemon instead of over UDP
+#endif
+#ifndef STREAM_MUX
+#define STREAM_MUX 0     // 1: frames carry a stream id and MTP sockets bound to the same address share one UDP socket
+#endif
+#define MUX_RECV_BATCH 32 // Datagrams R_Thread reads from a shared UDP socket per wakeup
+#ifndef FRAME_CRC
+#define FRAME_CRC 0      // 1: data frames carry a CRC32C of their sequence number and payload, checked by R_Thread
+#endif
+#ifndef UDP_OFFLOAD
+#define UDP_OFFLOAD 1    // 1: the data frames of a window go out as one UDP GSO send and arrive as GRO batches
+#endif
 
-#define KEY_MTP_TABLE 100
+#define MTP_SHM_NAME "/mtp_table"      // POSIX shared memory object of the MTP table (shm_open), ".<instance>" appended
+#define MTP_HUGETLBFS "/dev/hugepages"  // hugetlbfs mount holding the MTP table instead with MTP_HUGEPAGES=hugetlb
+#define MTP_HUGE_PAGE (2UL << 20)       // Transparent huge page size the table is rounded up to with MTP_HUGEPAGES=thp
+#define MTP_INSTANCE_MAX 32             // Longest instance name (MTP_INSTANCE)
+#define MTP_NAME_MAX (sizeof(MTP_SHM_NAME) + 1 + MTP_INSTANCE_MAX)     // Size of the name of the table of an instance
+#define MTP_PATH_MAX (sizeof(MTP_HUGETLBFS) + MTP_NAME_MAX)            // Size of its path on MTP_HUGETLBFS
+// System V keys of the objects of an instance (see mtp_ipc_key)
 #define KEY_SHARED_RESOURCE 35
 #define KEY_ENTRY_SEM 23
 #define KEY_EXIT_SEM 21
@@ -28,26 +56,118 @@
 #define KEY_MUTEX_RECVBUF 89
 #define KEY_MUTEX_SENDBUF 65
 
-#define SIZE_SM 25       // Shared memory size
+#ifndef SIZE_SM
+#define SIZE_SM 25       // Shared memory size (MTP sockets, including the peers of server sockets)
+#endif
 #define KB 1000          // Kilobyte size
 #define IP_SIZE 20       // Maximum IP address size
 #define SEND_BUFFSIZE 10 // Send buffer size
-#define RECV_BUFFSIZE 5  // Receive buffer size
+#ifndef RECV_BUFFSIZE
+#define RECV_BUFFSIZE 5  // Receive buffer size (the window; bench.sh overrides it, keep it <= SEND_BUFFSIZE / 2)
+#endif
 #define SWND_SIZE 5      // Send window size
 #define RWND_SIZE 5      // Receive window size
 #define MAX_SEQ_NO 16    // Maximum sequence number
+#define FRAME_MAX (KB + 8) // Largest frame on the wire: type, stream id, sequence number, payload, CRC32C
+#define GSO_MAX_BYTES (SEND_BUFFSIZE * FRAME_MAX) // Largest GSO send: a whole send buffer of frames
+#define GRO_BUF_SIZE 65536 // Largest GRO batch R_Thread reads at once
+#define CACHE_LINE 64    // Cache line size in bytes
+
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
 
 #define TIMEOUT_S 4   // Timeout in seconds
 #define TIMEOUT_US 0  // Timeout in microseconds
 #define T 5           // Timeout time preiod and sleep time
 #define GARBAGE_T 200 // G_Thread sleep time
+#define IMPAIR_QUEUE_SIZE 256 // Frames the impairment emulator can hold back for delay and reordering
+#define LINGER_T (6 * T)      // Seconds without ACK progress before giving up on the messages of an exited process:
+                              // a lost frame is resent about every T seconds, and each copy or its ACK may be lost again
+#define LINGER_CHECK_MS 200   // G_Thread: how often the sockets of exited processes are checked while they drain
+#define LOG_RING_SIZE 1024    // Log lines buffered per daemon thread (power of 2)
+#define LOG_LINE_SIZE 120     // Maximum length of a log line
+#define LOG_MAX_THREADS 16    // Daemon threads that can get their own log ring
+#define LOG_FLUSH_US 10000    // Log flusher sleep when all rings are empty
+#define MAX_POLLERS 64        // Processes that can wait in m_poll at the same time
+#define LZ_HASH_BITS 10       // Hash table size (log2) of the payload compressor
+#define LZ_MIN_MATCH 4        // Shortest match the payload compressor encodes
+#define LZ_MIN_GAIN 64        // Bytes a compressed data frame must save, or the message is sent raw
+#define DRR_QUANTUM 2         // Messages a socket of weight 1 sends per pass of S_Thread (one GSO send)
+#define MTP_WEIGHT_MAX 64     // Largest weight m_setweight accepts
+#define PEER_HASH_SIZE 1024   // Slots of the peer hash table of server sockets (power of 2, >= 2 * SIZE_SM)
+#define URING_ENTRIES 256     // Submission queue of the io_uring of the R and S threads (MTP_IO=uring)
+#define URING_BUFS 64         // Receive buffers R_Thread provides to the kernel with MTP_IO=uring (power of 2, each holds a GRO batch)
+#define URING_SENDS 128       // Frames a thread can have in flight with MTP_IO=uring before it falls back to sendto
+#define MAX_CPUS 1024         // CPUs MTP_CPU_R and MTP_CPU_S can name, and NUMA nodes MTP_NUMA_NODE can name
+
+/*----------------- LOCKING -----------------*/
+/*  The daemon build guards the MTP table with robust process-shared pthread mutexes kept in the MTP table segment
+    (see locks.c): when a process dies holding one, the next process or thread taking it repairs what the dead one
+    left half done instead of blocking forever. m_sendto and m_recvfrom take none of the buffer locks (see BUFFER RINGS).
+    The in-process engine build (-DMTP_INPROC) keeps the table in process-private memory, so the same lock ids index
+    an array of plain pthread mutexes instead.
+    The entry and exit semaphores of the request handshake with initmsocket stay SysV semaphores (sem_down, sem_up). */
+#define LOCK_TABLE_INFO 0
+#define LOCK_SWND 1
+#define LOCK_RECVBUF 2
+#define LOCK_SENDBUF 3
+#define NUM_LOCKS 4
+
+#ifdef MTP_INPROC
+extern pthread_mutex_t inproc_locks[NUM_LOCKS];
+#define lock_down(s) pthread_mutex_lock(&inproc_locks[s])
+#define lock_up(s) pthread_mutex_unlock(&inproc_locks[s])
+#else
+extern struct sembuf pop, vop;
+int lock_acquire(int lock);
+int lock_release(int lock);
+void lock_init(int lock);
+#define lock_down(s) lock_acquire(s)
+#define lock_up(s) lock_release(s)
+#define sem_down(s) semop(s, &pop, 1)
+#define sem_up(s) semop(s, &vop, 1)
+#endif
+
+/*  Lock instrumentation (-DMTP_LOCKSTAT, see lockstat.c): every down/up of one of the NUM_LOCKS mutexes records
+    the time spent waiting for it and the time it was held in log2 histograms in shared memory, read by mtplockstat.
+    The lock is recognised from the name of the variable holding its id (mtx_swnd, ...). */
+#define KEY_LOCKSTAT 47
+#define LOCKSTAT_BUCKETS 40 // Bucket b counts durations in [2^b, 2^(b+1)) ns, the last one everything longer
+
+typedef struct lock_histogram
+{
+    unsigned long long acquisitions;             // Number of down() calls
+    unsigned long long wait_total_ns;            // Total time spent waiting in down()
+    unsigned long long hold_total_ns;            // Total time between down() returning and up()
+    unsigned long long wait[LOCKSTAT_BUCKETS];   // Wait time histogram
+    unsigned long long hold[LOCKSTAT_BUCKETS];   // Hold time histogram
+} lock_histogram;
+
+typedef struct lockstat_table
+{
+    lock_histogram locks[NUM_LOCKS];
+} lockstat_table;
+
+lockstat_table *lockstat_attach();
+int lockstat_index(const char *name);
+const char *lockstat_name(int lock);
+unsigned long long lockstat_now();
+void lockstat_acquired(int lock, unsigned long long wait_start_ns);
+void lockstat_released(int lock);
+
+#ifdef MTP_LOCKSTAT
+#define down(s) do { int lock_ = lockstat_index(#s); unsigned long long start_ = lockstat_now(); lock_down(s); lockstat_acquired(lock_, start_); } while (0)
+#define up(s) do { lockstat_released(lockstat_index(#s)); lock_up(s); } while (0)
+#else
+#define down(s) lock_down(s) // wait(s)
+#define up(s) lock_up(s)     // signal(s)
+#endif
 
 /*------------------ STRUCTURES ----------------*/
 typedef struct message
 {
     int sequence_no; // Sequence number of the message
     char data[KB];   // Data payload of the message
-} message;
+} CACHE_ALIGNED message;
 
 typedef struct send_window
 {
@@ -56,19 +176,79 @@ typedef struct send_window
     int last_ack_seqno;                     // Last acknowledged sequence number
     int last_ack_emptyspace;                // Last acknowledged empty space in receive window
     int last_sent;                          // Index number of the last sent message
-    time_t last_active_time[SEND_BUFFSIZE]; // Time of last activity for each message in the send buffer
-    int new_entry;                          // Index number of the new entry in the send buffer
+    unsigned long long last_sent_ns[SEND_BUFFSIZE];  // Time the message was last sent, 0 if never (timeouts)
+    unsigned long long first_sent_ns[SEND_BUFFSIZE]; // Time the message was first sent, 0 once retransmitted (RTT samples)
+
+    /* written by m_sendto, kept off the cache lines the daemon writes */
+    int new_entry CACHE_ALIGNED;            // Index number of the new entry in the send buffer
     int last_seq_no;                        // Last sequence number used in m-sendto(...) to keep track of message sequencing
 } send_window;
 
 typedef struct receive_window
 {
-    int window[5];             // Array representing the receive window
-    int last_inorder_received; // Last message received in order
-    int last_user_taken;       // Last message consumed by the user
-    int nospace;               // Number of empty spaces in the receive window
+    int last_inorder_received;   // Last message received in order
+    int nospace;                 // Number of empty spaces in the receive window
+    unsigned long long inserted; // Number of messages put in the receive buffer by R_Thread
+
+    /* written by m_recvfrom, kept off the cache line R_Thread writes */
+    unsigned long long consumed CACHE_ALIGNED; // Number of messages consumed by the user (see rwnd_head)
 } receive_window;
 
+/*  Network impairment applied to the frames arriving at an MTP socket (data frames for a receiver,
+    ACKs for a sender), set at runtime with m_setimpair. Every socket starts with loss = P and nothing else. */
+typedef struct impair_config
+{
+    float loss;              // Loss probability (Bernoulli, or in the good state of the Gilbert-Elliott model)
+    float ge_p;              // Gilbert-Elliott: probability of moving from the good to the bad state, 0 for Bernoulli loss
+    float ge_r;              // Gilbert-Elliott: probability of moving from the bad to the good state
+    float ge_loss_bad;       // Gilbert-Elliott: loss probability in the bad state
+    int delay_us;            // Added one-way delay in microseconds
+    int jitter_us;           // The delay varies uniformly in [delay_us - jitter_us, delay_us + jitter_us]
+    float reorder;           // Probability that a frame skips the delay and overtakes the delayed ones
+    float duplicate;         // Probability that a frame is delivered twice
+    float corrupt;           // Probability that a bit of a data frame is flipped (detected with FRAME_CRC)
+    int rate_kbps;           // Bandwidth cap of the link into the socket in kbit/s, 0 for none
+    unsigned long long seed; // PRNG seed, 0 to derive it from the daemon seed (MTP_SEED) and the socket id
+} impair_config;
+
+/*  R_Thread impairs the frames arriving over UDP and S_Thread those of the same-host fast path, so each thread has
+    its own generator and Gilbert-Elliott chain per socket: the drops do not depend on how the threads interleave. */
+#define IMPAIR_R 0       // Generator of R_Thread
+#define IMPAIR_S 1       // Generator of S_Thread
+#define IMPAIR_THREADS 2
+
+typedef struct impair_state
+{
+    unsigned long long rng[IMPAIR_THREADS]; // splitmix64 state of each thread
+    int ge_bad[IMPAIR_THREADS];             // Gilbert-Elliott: 1 while the chain of that thread is in the bad state
+    unsigned long long link_free_ns;        // Time at which the capped link has finished sending the previous frame (R_Thread)
+} impair_state;
+
+/*  Per-socket counters for mtpstat. They are written with relaxed atomics (STAT_ADD) by the daemon threads and
+    the library, so that they can be read at any time without taking the locks. */
+typedef struct mtp_stats
+{
+    unsigned long long msgs_sent;       // Data frames sent for the first time
+    unsigned long long bytes_sent;      // Payload bytes of those frames
+    unsigned long long retransmissions; // Data frames sent again after a timeout
+    unsigned long long timeouts;        // Timeouts detected by S_Thread
+    unsigned long long msgs_received;   // New data frames put in the receive buffer
+    unsigned long long bytes_received;  // Payload bytes of those frames
+    unsigned long long dup_acks;        // Duplicate ACKs ignored
+    unsigned long long drops;           // Frames lost by the impairment emulator or failing the CRC check
+    unsigned long long crc_errors;      // Data frames dropped because their CRC32C did not match (FRAME_CRC)
+    unsigned long long discarded;       // Data frames already received or outside the receive window
+    unsigned long long sendbuf_full;    // m_sendto calls refused because the send buffer was full
+    unsigned long long rwnd_full;       // ACKs advertising a full receive buffer
+    unsigned long long rtt_us;          // Smoothed RTT (1/8 gain), sampled only on messages sent once
+    unsigned long long rtt_var_us;      // Smoothed mean deviation of the RTT samples (1/4 gain)
+    unsigned long long rtt_min_us;      // Smallest RTT sample
+    unsigned long long compressed;      // Data frames sent compressed (m_setcompress)
+    unsigned long long wire_bytes;      // Bytes of the data frames sent over UDP, headers included
+} mtp_stats;
+
+#define STAT_ADD(socket, field, n) __atomic_fetch_add(&(socket).stats.field, (n), __ATOMIC_RELAXED)
+
 typedef struct mtp_socket
 {
     int free;                         // Flag indicating if the MTP socket is free
@@ -76,27 +256,306 @@ typedef struct mtp_socket
     int udp_sockid;                   // UDP socket ID
     char dest_ip[IP_SIZE];            // Destination IP address
     unsigned short int dest_port;     // Destination port
+    int stream_id;                    // Stream id carried in the frames when STREAM_MUX is set (m_setstream)
+    int compress;                     // Send data frames compressed when it pays off (m_setcompress)
+    int weight;                       // Share of S_Thread's sending, 1 to MTP_WEIGHT_MAX (m_setweight)
+    struct sockaddr_in src_addr;      // Address the UDP socket is bound to (port 0 if unbound)
+    int server;                       // Server socket (m_listen) this socket is or is a peer of, -1 if none
+    int next_peer;                    // Server socket: peer m_recvfrom looks at first
+    int poller;                       // m_poll slot of the process last waiting on this socket, -1 if none
+    send_window swnd CACHE_ALIGNED;   // Send window
+    receive_window rwnd CACHE_ALIGNED; // Receive window
+    impair_config impair CACHE_ALIGNED; // Network impairment of the link into this socket
+    impair_state impair_st;             // Random state of the impairment emulator
+    mtp_stats stats CACHE_ALIGNED;      // Counters shown by mtpstat
+} mtp_socket;
+
+/*  Set of MTP socket ids as a bitmap, so the threads visit only the members (found with ctz)
+    instead of testing every one of the SIZE_SM entries. Updated with atomic read-modify-writes
+    since both user processes and the daemon threads change it. */
+#define SET_WORDS ((SIZE_SM + 63) / 64)
+
+typedef struct socket_set
+{
+    unsigned long long bits[SET_WORDS];
+} CACHE_ALIGNED socket_set;
+
+/*  Entry of the peer hash table: the MTP socket holding the windows of the peer addr:port (network
+    byte order) of a server socket. Open addressing with linear probing; the daemon inserts and removes
+    under mtx_table_info, and m_sendto looks up under it too. */
+typedef struct peer_entry
+{
+    unsigned int addr;   // Peer IP address
+    unsigned short port; // Peer port
+    short used;          // Slot in use
+    int server;          // Server socket
+    int peer;            // MTP socket of the peer
+} peer_entry;
+
+_Static_assert(PEER_HASH_SIZE >= 2 * SIZE_SM && (PEER_HASH_SIZE & (PEER_HASH_SIZE - 1)) == 0, "PEER_HASH_SIZE");
+
+/*  m_poll slot of a process: the daemon increments seq whenever a socket the process polls becomes ready, and
+    wakes it with FUTEX_WAKE if it is blocked (waiting > 0) in FUTEX_WAIT on seq. */
+typedef struct poll_waiter
+{
+    pid_t pid;         // Process owning the slot, 0 if free
+    unsigned int seq;  // Wakeup sequence number (futex word)
+    int waiting;       // Threads of the process blocked on seq
+} CACHE_ALIGNED poll_waiter;
+
+typedef struct robust_lock
+{
+    pthread_mutex_t mutex;  // PTHREAD_PROCESS_SHARED and PTHREAD_MUTEX_ROBUST (daemon build)
+    unsigned int recovered; // Times the lock was taken over from a dead owner
+} CACHE_ALIGNED robust_lock;
+
+typedef struct mtp_buffers
+{
     message send_buff[SEND_BUFFSIZE]; // Send buffer
     message recv_buff[RECV_BUFFSIZE]; // Receive buffer
-    send_window swnd;                 // Send window
-    receive_window rwnd;              // Receive window
-} mtp_socket;
+} mtp_buffers;
+
+/*  First bytes of the MTP table segment, checked by mtp_table_open before a process uses the table: initmsocket
+    sets magic once the table is initialized, and a library built with a different layout (another SIZE_SM,
+    buffer size or version of the structures) refuses the table instead of corrupting it.
+    MTP_TABLE_VERSION is increased whenever the layout of mtp_shared_table changes. */
+#define MTP_TABLE_MAGIC 0x5450544dU // "MTPT"
+#define MTP_TABLE_VERSION 4
+#define TABLE_SHM 0     // Backing of the table: POSIX shared memory with 4 KB pages
+#define TABLE_THP 1     // POSIX shared memory with transparent huge pages (madvise)
+#define TABLE_HUGETLB 2 // File on hugetlbfs
+
+typedef struct mtp_table_header
+{
+    unsigned int magic;        // MTP_TABLE_MAGIC once initmsocket has initialized the table, 0 before
+    unsigned int version;      // MTP_TABLE_VERSION of initmsocket
+    unsigned long long size;   // sizeof(mtp_shared_table) of initmsocket
+    unsigned long long mapped; // Size of the shared memory object (rounded up to the page size of the backing)
+    int backing;               // TABLE_SHM, TABLE_THP or TABLE_HUGETLB
+} CACHE_ALIGNED mtp_table_header;
+
+/*  Layout of the MTP table segment: the control metadata of all sockets is packed in front so that
+    the scans over SIZE_SM entries stay within a few pages, and the payload buffers follow it.
+    Entry i of both arrays belongs to MTP socket i. */
+typedef struct mtp_shared_table
+{
+    mtp_table_header header;      // Version and state of the segment
+    mtp_socket sockets[SIZE_SM];  // Control metadata
+    mtp_buffers buffers[SIZE_SM]; // Payload buffers
+    socket_set active;            // Sockets in use, maintained by the daemon
+    socket_set pending_send;      // Sockets that may have messages in the send buffer
+    socket_set readable;          // Sockets whose next in-order message has arrived (m_poll)
+    socket_set writable;          // Sockets with space in the send buffer (m_poll)
+    poll_waiter pollers[MAX_POLLERS]; // m_poll wakeup slots of the processes
+    poll_waiter send_waiter;          // Wakeup of S_Thread (send_wake), pid unused
+    peer_entry peers[PEER_HASH_SIZE]; // Peers of the server sockets by address
+    robust_lock locks[NUM_LOCKS];     // The locks (daemon build)
+} mtp_shared_table;
+
+#define MTP_SHARED(MTP_Table) ((mtp_shared_table *)((char *)(MTP_Table) - offsetof(mtp_shared_table, sockets)))
+#define MTP_BUFFERS(MTP_Table) (MTP_SHARED(MTP_Table)->buffers)
+
+/*------------------ BUFFER RINGS ----------------*/
+/*  The send buffer is a single-producer single-consumer ring from m_sendto (writing slot new_entry) to the daemon, and
+    the receive buffer one from R_Thread to m_recvfrom (taking slot rwnd_head), so neither side takes a lock or makes a
+    system call to hand a message over. The sequence number of a slot is its state: the message in it, or a free
+    mark. The producer fills a free slot and then stores its sequence number (release); the consumer reads the
+    sequence number (acquire) before the data, and stores the free mark (release) once it no longer reads the slot.
+    The daemon threads on one side still serialize among themselves with mtx_swnd, mtx_sendbuf and mtx_recvbuf.
+    A free send slot holds -1: m_sendto fills the slots in order. A free receive slot holds rwnd_free_mark, the negated
+    sequence number of the message that goes in it next, since R_Thread places messages by their distance from a
+    consumed count that may be stale: a copy of a message m_recvfrom has just taken then finds its slot not free for it. */
+static inline int slot_seq(message *slot)
+{
+    return __atomic_load_n(&slot->sequence_no, __ATOMIC_ACQUIRE);
+}
+
+static inline void slot_set(message *slot, int seq)
+{
+    __atomic_store_n(&slot->sequence_no, seq, __ATOMIC_RELEASE);
+}
+
+// Receive buffer slot of the next message m_recvfrom takes, after it has taken consumed messages
+static inline int rwnd_head(unsigned long long consumed)
+{
+    return (int)(consumed % RECV_BUFFSIZE);
+}
+
+// Sequence number of the last message m_recvfrom took (0 before the first one)
+static inline int rwnd_last_taken(unsigned long long consumed)
+{
+    return (consumed == 0) ? 0 : (int)((consumed - 1) % MAX_SEQ_NO) + 1;
+}
+
+// Free mark of the receive slot whose next message is message number n (from 0) of the connection
+static inline int rwnd_free_mark(unsigned long long n)
+{
+    return -(int)(n % MAX_SEQ_NO) - 1;
+}
+
+/*------------------ SOCKET SETS ----------------*/
+static inline void socket_set_add(socket_set *set, int i)
+{
+    __atomic_fetch_or(&set->bits[i / 64], 1ULL << (i % 64), __ATOMIC_RELEASE);
+}
+
+static inline void socket_set_remove(socket_set *set, int i)
+{
+    __atomic_fetch_and(&set->bits[i / 64], ~(1ULL << (i % 64)), __ATOMIC_RELEASE);
+}
+
+static inline int socket_set_has(socket_set *set, int i)
+{
+    return (__atomic_load_n(&set->bits[i / 64], __ATOMIC_ACQUIRE) >> (i % 64)) & 1;
+}
+
+static inline void socket_set_clear(socket_set *set)
+{
+    for (int w = 0; w < SET_WORDS; w++)
+        __atomic_store_n(&set->bits[w], 0ULL, __ATOMIC_RELEASE);
+}
+
+// Smallest member (or non-member if complement is set) of the set that is >= from, -1 if none
+static inline int socket_set_next(socket_set *set, int from, int complement)
+{
+    for (int w = from / 64; w < SET_WORDS; w++)
+    {
+        unsigned long long bits = __atomic_load_n(&set->bits[w], __ATOMIC_ACQUIRE);
+        if (complement)
+            bits = ~bits;
+        if (w == from / 64)
+            bits &= ~0ULL << (from % 64);
+        if (bits)
+        {
+            int i = w * 64 + __builtin_ctzll(bits);
+            return (i < SIZE_SM) ? i : -1;
+        }
+    }
+    return -1;
+}
+
+#define for_each_socket(i, set) for (int i = socket_set_next(set, 0, 0); i >= 0; i = socket_set_next(set, i + 1, 0))
+#define for_each_free_socket(i, set) for (int i = socket_set_next(set, 0, 1); i >= 0; i = socket_set_next(set, i + 1, 1))
+
+/*------------------ S THREAD WAKEUP ----------------*/
+/*  S_Thread sleeps in FUTEX_WAIT on send_waiter.seq when no socket has anything it can send. m_sendto (a socket joins
+    pending_send), an ACK that opens a window and m_recvfrom on a socket that advertised a full buffer increment seq;
+    the FUTEX_WAKE system call is only made while S_Thread is asleep. */
+static inline void send_wake(poll_waiter *w)
+{
+    __atomic_fetch_add(&w->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->waiting, __ATOMIC_SEQ_CST) > 0)
+        syscall(SYS_futex, &w->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*------------------ PEER HASH ----------------*/
+static inline int peer_hash(int server, unsigned int addr, unsigned short port)
+{
+    unsigned int h = addr * 2654435761u ^ (((unsigned int)port << 8) ^ (unsigned int)server) * 2246822519u;
+    return (h ^ (h >> 15)) & (PEER_HASH_SIZE - 1);
+}
+
+// Slot of the peer addr:port of the server socket, -1 if it has none
+static inline int peer_hash_slot(peer_entry *peers, int server, unsigned int addr, unsigned short port)
+{
+    for (int k = peer_hash(server, addr, port); peers[k].used; k = (k + 1) & (PEER_HASH_SIZE - 1))
+    {
+        if (peers[k].server == server && peers[k].addr == addr && peers[k].port == port)
+            return k;
+    }
+    return -1;
+}
+
+// MTP socket of the peer addr:port of the server socket, -1 if it has none
+static inline int peer_hash_find(peer_entry *peers, int server, unsigned int addr, unsigned short port)
+{
+    int k = peer_hash_slot(peers, server, addr, port);
+    return (k < 0) ? -1 : peers[k].peer;
+}
+
+// There is always a free slot since PEER_HASH_SIZE > SIZE_SM
+static inline void peer_hash_insert(peer_entry *peers, int server, unsigned int addr, unsigned short port, int peer)
+{
+    int k = peer_hash(server, addr, port);
+    while (peers[k].used)
+        k = (k + 1) & (PEER_HASH_SIZE - 1);
+    peers[k].addr = addr;
+    peers[k].port = port;
+    peers[k].server = server;
+    peers[k].peer = peer;
+    peers[k].used = 1;
+}
+
+// Removes the entry and moves back the entries after it that its slot kept from their home slot
+static inline void peer_hash_remove(peer_entry *peers, int server, unsigned int addr, unsigned short port)
+{
+    int hole = peer_hash_slot(peers, server, addr, port);
+    if (hole < 0)
+        return;
+    peers[hole].used = 0;
+    for (int k = (hole + 1) & (PEER_HASH_SIZE - 1); peers[k].used; k = (k + 1) & (PEER_HASH_SIZE - 1))
+    {
+        int home = peer_hash(peers[k].server, peers[k].addr, peers[k].port);
+        if ((hole < k) ? (hole < home && home <= k) : (hole < home || home <= k))
+            continue;
+        peers[hole] = peers[k];
+        peers[k].used = 0;
+        hole = k;
+    }
+}
 
 typedef struct shared_variables
 {
     int status;                  // Status of the shared variables
     int mtp_id;                  // MTP ID associated with the shared variables
     struct sockaddr_in src_addr; // Source address
+    impair_config impair;        // Impairment configuration for m_setimpair
 
     int return_value; // Return value from functions
     int error_no;     // Error number associated with the shared variables
+
+    unsigned int request_no; // Number of the last request handed to initmsocket
+    unsigned int reply_no;   // Number of the last request initmsocket has served
 } shared_variables;
 
+/*  m_poll: same values as POLLIN, POLLOUT and POLLNVAL */
+#define M_POLLIN 0x001
+#define M_POLLOUT 0x004
+#define M_POLLNVAL 0x020
+
+struct m_pollfd
+{
+    int fd;        // MTP socket (ignored if negative)
+    short events;  // M_POLLIN and/or M_POLLOUT
+    short revents; // Events that are ready, or M_POLLNVAL
+};
+
 /*--------------- FUNCTION DECLARATIONS ---------------*/
 int m_socket(int domain, int type, int protocol);
 int m_bind(int socket_id, char *src_ip, unsigned short int src_port, char *dest_ip, unsigned short int dest_port);
 int m_sendto(int socket_id, char *buffer, int size, int flags, struct sockaddr *dest, int len);
 int m_recvfrom(int socket_id, char *buffer, int size, int flags, struct sockaddr *dest, int *len);
 int m_close(int socket_id);
+int m_setimpair(int socket_id, impair_config *config);
+int m_setstream(int socket_id, int stream_id);
+int m_setcompress(int socket_id, int on);
+int m_setweight(int socket_id, int weight);
+int m_listen(int socket_id);
+int m_poll(struct m_pollfd *fds, int n, int timeout_ms);
+void printTable();
+void printStats();
+
+const char *mtp_instance();
+int mtp_table_name(char *name);
+key_t mtp_ipc_key(int id);
+mtp_shared_table *mtp_table_open();
+void mtp_table_adopt(mtp_shared_table *shared);
+
+void my_strcpy(char *a1, char *a2, int size);
+int min_logical(int x, int y, int size);
 
-int dropMessage(float p); // Function to simulate dropping of messages based on a probability
+#ifdef MTP_INPROC
+/* In-process engine (initmsocket.c compiled into the library) */
+void mtp_engine_start(mtp_socket *MTP_Table, shared_variables *shared_resource);
+void process_request(mtp_socket *MTP_Table, shared_variables *shared_resource);
+#endif
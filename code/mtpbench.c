@@ -0,0 +1,126 @@
+#include "msocket.h"
+
+/*
+    mtpbench: sender or receiver of one benchmark transfer, modeled on user1.c and user2.c.
+    Run by bench.sh, which starts initmsocket and the socket pairs and collects the results.
+
+    usage: mtpbench send|recv <local port> <peer port> <size in KB> <loss> <seed>
+
+    The sender sends <size> chunks of KB bytes generated from the chunk number, then a chunk starting with '#', and
+    keeps its socket open until it is killed, so that bench.sh can read the counters of the socket with mtpstat.
+    The receiver checks every chunk and prints "RESULT <bytes> <chunks> <ok>" once it gets the '#' chunk.
+    Both sides set the loss of their socket with m_setimpair, so the loss rate needs no rebuild.
+*/
+
+#define IP "127.0.0.1"
+
+/*
+    Function: fill_chunk
+    Arguments: char *buffer, int chunk
+    Return Value: void
+    Workflow: Fills buffer with the KB bytes of the given chunk number (no '\0' and no '#' in first position).
+*/
+void fill_chunk(char *buffer, int chunk)
+{
+    for (int j = 0; j < KB; j++)
+    {
+        buffer[j] = 'a' + (chunk * 7 + j) % 26;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 7)
+    {
+        fprintf(stderr, "usage: %s send|recv <local port> <peer port> <size in KB> <loss> <seed>\n", argv[0]);
+        return 1;
+    }
+
+    int sender = (strcmp(argv[1], "send") == 0);
+    unsigned short local_port = atoi(argv[2]);
+    unsigned short peer_port = atoi(argv[3]);
+    int chunks = atoi(argv[4]);
+
+    int id = m_socket(AF_INET, SOCK_MTP, 0);
+    if (id < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+
+    impair_config impair;
+    memset(&impair, 0, sizeof(impair));
+    impair.loss = atof(argv[5]);
+    impair.seed = strtoull(argv[6], NULL, 0) * 65536 + local_port;
+    if (m_setimpair(id, &impair) < 0)
+    {
+        perror("setimpair");
+        return 1;
+    }
+
+    if (m_bind(id, IP, local_port, IP, peer_port) < 0)
+    {
+        perror("bind");
+        return 1;
+    }
+
+    char buffer[KB];
+
+    struct sockaddr_in dest;
+    dest.sin_family = AF_INET;
+    dest.sin_addr.s_addr = inet_addr(IP);
+    dest.sin_port = htons(peer_port);
+    int len = sizeof(dest);
+
+    if (sender)
+    {
+        for (int i = 0; i <= chunks; i++)
+        {
+            fill_chunk(buffer, i);
+            if (i == chunks)
+            {
+                buffer[0] = '#';
+            }
+            while (m_sendto(id, buffer, KB, 0, (struct sockaddr *)&dest, sizeof(dest)) < 0)
+            {
+                usleep(1000);
+            }
+        }
+        // the socket and its counters stay until bench.sh has read them and ends the sender
+        while (1)
+        {
+            pause();
+        }
+    }
+
+    char expected[KB];
+    int received = 0;
+    int ok = 1;
+    while (1)
+    {
+        while (m_recvfrom(id, buffer, KB, 0, (struct sockaddr *)&dest, &len) < 0)
+        {
+            usleep(1000);
+        }
+
+        if (buffer[0] == '#')
+        {
+            break;
+        }
+
+        fill_chunk(expected, received);
+        if (memcmp(buffer, expected, KB) != 0)
+        {
+            ok = 0;
+        }
+        received++;
+    }
+    if (received != chunks)
+    {
+        ok = 0;
+    }
+
+    printf("RESULT %d %d %d\n", received * KB, received, ok);
+    m_close(id);
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "msocket.h"
+
+/*
+    mtplockstat: prints the wait and hold time histograms of the MTP locks recorded by a build with
+    CFLAGS=-DMTP_LOCKSTAT (see lockstat.c), or clears them, and how often each lock was taken over from a process
+    that died holding it.
+
+    usage: mtplockstat [-r]
+
+    Run it with the MTP_INSTANCE of the initmsocket to look at (unset for the default instance), from any directory.
+*/
+
+/*
+    Function: percentile
+    Arguments: unsigned long long *hist, unsigned long long count, double q
+    Return Value: unsigned long long
+    Workflow: Returns the upper bound in ns of the histogram bucket holding the q-quantile.
+*/
+unsigned long long percentile(unsigned long long *hist, unsigned long long count, double q)
+{
+    if (count == 0)
+        return 0;
+
+    unsigned long long seen = 0;
+    for (int b = 0; b < LOCKSTAT_BUCKETS; b++)
+    {
+        seen += hist[b];
+        if (seen > 0 && seen >= q * count)
+            return 2ULL << b;
+    }
+    return 2ULL << (LOCKSTAT_BUCKETS - 1);
+}
+
+/*
+    Function: print_histogram
+    Arguments: const char *what, unsigned long long *hist
+    Return Value: void
+    Workflow: Prints the non-empty buckets of a histogram, one "[low, high) ns count" line each.
+*/
+void print_histogram(const char *what, unsigned long long *hist)
+{
+    printf("  %s\n", what);
+    for (int b = 0; b < LOCKSTAT_BUCKETS; b++)
+    {
+        if (hist[b] != 0)
+            printf("    [%llu, %llu) ns\t%llu\n", (b == 0) ? 0ULL : 1ULL << b, 2ULL << b, hist[b]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    lockstat_table *table = lockstat_attach();
+    if (table == NULL)
+    {
+        perror("shmat");
+        return 1;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-r") == 0)
+    {
+        memset(table, 0, sizeof(lockstat_table));
+        return 0;
+    }
+
+    printf("%-15s %12s %12s %10s %10s %12s %10s %10s\n", "lock", "acquisitions", "wait_avg_ns", "wait_p50", "wait_p99",
+           "hold_avg_ns", "hold_p50", "hold_p99");
+    for (int i = 0; i < NUM_LOCKS; i++)
+    {
+        lock_histogram h = table->locks[i];
+        unsigned long long n = h.acquisitions ? h.acquisitions : 1;
+        printf("%-15s %12llu %12llu %10llu %10llu %12llu %10llu %10llu\n", lockstat_name(i), h.acquisitions,
+               h.wait_total_ns / n, percentile(h.wait, h.acquisitions, 0.5), percentile(h.wait, h.acquisitions, 0.99),
+               h.hold_total_ns / n, percentile(h.hold, h.acquisitions, 0.5), percentile(h.hold, h.acquisitions, 0.99));
+    }
+    for (int i = 0; i < NUM_LOCKS; i++)
+    {
+        if (table->locks[i].acquisitions == 0)
+            continue;
+        printf("\n%s\n", lockstat_name(i));
+        print_histogram("wait", table->locks[i].wait);
+        print_histogram("hold", table->locks[i].hold);
+    }
+
+    // taken over from processes that died holding them (recorded in every build, see locks.c)
+    mtp_shared_table *shared = mtp_table_open();
+    for (int i = 0; shared != NULL && i < NUM_LOCKS; i++)
+    {
+        if (shared->locks[i].recovered != 0)
+            printf("\n%s recovered from a dead owner %u times\n", lockstat_name(i), shared->locks[i].recovered);
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+#include "msocket.h"
+
+/*
+    mtpstat: prints the counters of every MTP socket in use (see printStats in msocket.c).
+
+    usage: mtpstat [interval]
+
+    Run it with the MTP_INSTANCE of the initmsocket to look at (unset for the default instance), from any directory.
+    With an interval (in seconds) the table is printed again every interval seconds.
+*/
+int main(int argc, char *argv[])
+{
+    int interval = (argc > 1) ? atoi(argv[1]) : 0;
+
+    while (1)
+    {
+        printStats();
+        if (interval <= 0)
+        {
+            break;
+        }
+        printf("\n");
+        fflush(stdout);
+        sleep(interval);
+    }
+    return 0;
+}
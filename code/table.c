@@ -0,0 +1,167 @@
+#include "msocket.h"
+
+/*
+    Mapping of the MTP table. initmsocket creates it as the POSIX shared memory object MTP_SHM_NAME, or as a file
+    of the same name on the hugetlbfs mount MTP_HUGETLBFS (see create_shared_MTP_Table in initmsocket.c), and every
+    other process maps it once and keeps the mapping: the table is found by name and not through ftok(".") of the
+    working directory, and the library does not map and unmap it on every call.
+    Every IPC object is named after the instance of the process (environment variable MTP_INSTANCE), so that
+    several initmsocket run side by side on a host, each with its own table, locks, request handshake and threads.
+*/
+
+static mtp_shared_table *table_mapping = NULL;
+
+/*
+    Function: mtp_instance
+    Arguments: None
+    Return Value: const char *
+    Workflow: Returns the instance name of this process, the environment variable MTP_INSTANCE, "" when it is
+              unset or empty (the default instance). Returns NULL if it is not a valid name: more than
+              MTP_INSTANCE_MAX characters, or other characters than letters, digits, '-' and '_'.
+*/
+const char *mtp_instance()
+{
+    const char *name = getenv("MTP_INSTANCE");
+    if (name == NULL)
+        return "";
+    if (strlen(name) > MTP_INSTANCE_MAX)
+        return NULL;
+    for (const char *c = name; *c != '\0'; c++)
+    {
+        if (!isalnum((unsigned char)*c) && *c != '-' && *c != '_')
+            return NULL;
+    }
+    return name;
+}
+
+/*
+    Function: mtp_table_name
+    Arguments: char *name
+    Return Value: int
+    Workflow: Writes to name (MTP_NAME_MAX bytes) the name of the shared memory object of the MTP table of the
+              instance: MTP_SHM_NAME for the default instance, MTP_SHM_NAME ".<instance>" otherwise.
+              Returns 0, or -1 with errno EINVAL if MTP_INSTANCE is not a valid name.
+*/
+int mtp_table_name(char *name)
+{
+    const char *instance = mtp_instance();
+    if (instance == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (instance[0] == '\0')
+        snprintf(name, MTP_NAME_MAX, "%s", MTP_SHM_NAME);
+    else
+        snprintf(name, MTP_NAME_MAX, "%s.%s", MTP_SHM_NAME, instance);
+    return 0;
+}
+
+/*
+    Function: mtp_ipc_key
+    Arguments: int id
+    Return Value: key_t
+    Workflow: System V key of the object id (KEY_SHARED_RESOURCE, KEY_ENTRY_SEM, ...) of the instance, in place of
+              ftok(".", id): like ftok, id is kept in the top 8 bits, and the low 24 bits are a hash (FNV-1a) of the
+              instance name instead of the inode of a directory.
+*/
+key_t mtp_ipc_key(int id)
+{
+    const char *instance = mtp_instance();
+    unsigned int hash = 2166136261U;
+    for (const char *c = (instance == NULL) ? "" : instance; *c != '\0'; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619U;
+    }
+    return (key_t)(((unsigned int)(id & 0xff) << 24) | (hash & 0xffffff));
+}
+
+/*
+    Function: mtp_table_adopt
+    Arguments: mtp_shared_table *shared
+    Return Value: void
+    Workflow: Called by initmsocket with the mapping it created, so that mtp_table_open returns it in the daemon
+              (the header is not valid yet while the daemon initializes the table).
+*/
+void mtp_table_adopt(mtp_shared_table *shared)
+{
+    __atomic_store_n(&table_mapping, shared, __ATOMIC_RELEASE);
+}
+
+/*
+    Function: map_table
+    Arguments: int fd
+    Return Value: mtp_shared_table *
+    Workflow: Maps the whole shared memory object open on fd after checking its header: the object must hold a table
+              of this layout (EPROTO otherwise) initialized by initmsocket (EAGAIN while it is starting). Returns NULL
+              with errno set on failure. fd is not closed.
+*/
+static mtp_shared_table *map_table(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return NULL;
+    if (st.st_size < (off_t)sizeof(mtp_shared_table))
+    {
+        errno = (st.st_size < (off_t)sizeof(mtp_table_header)) ? EAGAIN : EPROTO;
+        return NULL;
+    }
+
+    void *addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    mtp_table_header *header = &((mtp_shared_table *)addr)->header;
+    unsigned int magic = __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE);
+    if (magic != MTP_TABLE_MAGIC || header->version != MTP_TABLE_VERSION || header->size != sizeof(mtp_shared_table))
+    {
+        errno = (magic == 0) ? EAGAIN : EPROTO;
+        munmap(addr, st.st_size);
+        return NULL;
+    }
+    return (mtp_shared_table *)addr;
+}
+
+/*
+    Function: mtp_table_open
+    Arguments: None
+    Return Value: mtp_shared_table *
+    Workflow: Returns the MTP table of the initmsocket of the instance, mapping it the first time: the POSIX shared
+              memory object named by mtp_table_name, or the file of that name on MTP_HUGETLBFS if there is none. The
+              mapping is kept for the life of the process: the robust mutexes in it are found by the kernel through
+              their addresses, and a process uses one instance. Returns NULL with errno set if there is no table
+              (ENOENT: initmsocket is not running), MTP_INSTANCE is not valid (EINVAL) or the table can not be used.
+*/
+mtp_shared_table *mtp_table_open()
+{
+    mtp_shared_table *shared = __atomic_load_n(&table_mapping, __ATOMIC_ACQUIRE);
+    if (shared != NULL)
+        return shared;
+
+    char name[MTP_NAME_MAX];
+    char path[MTP_PATH_MAX];
+    if (mtp_table_name(name) < 0)
+        return NULL;
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0 && errno == ENOENT)
+    {
+        snprintf(path, sizeof(path), "%s%s", MTP_HUGETLBFS, name);
+        fd = open(path, O_RDWR);
+    }
+    if (fd < 0)
+        return NULL;
+
+    mtp_shared_table *addr = map_table(fd);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    if (addr == NULL)
+        return NULL;
+
+    // Two threads mapping it at once keep the first mapping, so that a mutex is always used at one address
+    if (__atomic_compare_exchange_n(&table_mapping, &shared, addr, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return addr;
+    munmap(addr, addr->header.mapped);
+    return shared;
+}